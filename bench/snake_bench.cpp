@@ -0,0 +1,255 @@
+#include "game.hpp"
+#include "game_util.hpp"
+#include "hamiltonian_cycle.hpp"
+#include "zig_zag_agent.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+//------------------------------------------------------------------------------
+// Micro-benchmarks for the core kernels
+//------------------------------------------------------------------------------
+
+// Times the hot kernels in isolation against a reproducible mid-game state,
+// so a kernel change can be measured without playing full games.
+// Output is a csv (or json with --json) of ns/op and bytes allocated per op,
+// meant to be diffed against a stored baseline.
+
+//------------------------------------------------------------------------------
+// Allocation counting
+//------------------------------------------------------------------------------
+
+// Total bytes ever requested through operator new; a kernel's allocations per
+// op are the difference across its timed loop.
+static size_t allocated_bytes = 0;
+
+void* operator new(size_t n) {
+  allocated_bytes += n;
+  void* p = std::malloc(n);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t n) {
+  return operator new(n);
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+//------------------------------------------------------------------------------
+// Timing
+//------------------------------------------------------------------------------
+
+struct KernelResult {
+  std::string name;
+  int board_size;
+  double ns_per_op;
+  double bytes_per_op;
+  long ops;
+};
+
+// Time f() until ~50ms of samples are collected (f is one op).
+// max_ops caps the total for ops that consume limited state, like Game::move.
+template <typename F>
+KernelResult bench(std::string const& name, int board_size, F&& f, long max_ops = 1000000) {
+  using clock = std::chrono::steady_clock;
+  f(); // warm up
+  long ops = 0;
+  size_t bytes0 = allocated_bytes;
+  auto t0 = clock::now();
+  double elapsed_ns;
+  do {
+    for (int i = 0; i < 10; ++i) f();
+    ops += 10;
+    elapsed_ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t0).count();
+  } while (elapsed_ns < 50e6 && ops + 10 <= max_ops);
+  return {name, board_size, elapsed_ns / ops, (double)(allocated_bytes - bytes0) / ops, ops};
+}
+
+//------------------------------------------------------------------------------
+// Reproducible mid-game state
+//------------------------------------------------------------------------------
+
+// The same seed derivation as snake --seed
+RNG bench_rng(int seed) {
+  uint64_t s[] = {1234567891234567890u, 9876543210987654321u + seed};
+  return RNG(s);
+}
+
+// Play the fixed zig-zag agent until the snake covers half the board. The
+// agent is deterministic, so the state depends only on the seed and size.
+std::unique_ptr<Game> midgame(CoordRange dims, int seed) {
+  RNG rng = bench_rng(seed);
+  auto game = std::make_unique<Game>(dims, rng.next_rng());
+  FixedZigZagAgent agent;
+  while (!game->done() && 2 * game->snake.size() < game->grid.size()) {
+    game->move(agent(*game));
+  }
+  return game;
+}
+
+//------------------------------------------------------------------------------
+// Kernels
+//------------------------------------------------------------------------------
+
+static volatile int sink = 0; // keep results observable
+
+void bench_kernels(int size, std::vector<KernelResult>& results) {
+  CoordRange dims = {size, size};
+  SearchContext ctx(dims);
+
+  auto game = midgame(dims, 42);
+  Coord head = game->snake_pos();
+  Coord apple = game->apple_pos;
+  auto can_move = [&](Coord from, Coord to, Dir dir) {
+    return !game->grid[to];
+  };
+
+  results.push_back(bench("generic_shortest_path", size, [&]{
+    generic_shortest_path(ctx, dims, can_move, head);
+  }));
+
+  results.push_back(bench("flood_fill", size, [&]{
+    flood_fill(ctx, dims, can_move, head);
+  }));
+
+  // heap-based A* with the dhcr edge weights (unbounded extra cost)
+  GridPath cycle = make_zig_zag_path(dims);
+  Grid<int> cycle_order = cycle_orders(cycle);
+  const int cycle_size = cycle_order.size();
+  const int goal_order = cycle_order[apple];
+  auto dhcr_edge = [&](Coord from, Coord to, Dir dir) {
+    if (game->grid[to]) return INT_MAX;
+    return 1000000 + (goal_order - cycle_order[to] + cycle_size) % cycle_size;
+  };
+  results.push_back(bench("astar_shortest_path_heap", size, [&]{
+    astar_shortest_path(ctx, dims, dhcr_edge, head, apple, 1000000);
+  }));
+
+  // bucket-queue A* with bounded edge costs, as used by the cell agents
+  auto uniform_edge = [&](Coord from, Coord to, Dir dir) {
+    return game->grid[to] ? INT_MAX : 1000;
+  };
+  results.push_back(bench("astar_shortest_path_bucket", size, [&]{
+    astar_shortest_path(ctx, dims, uniform_edge, head, apple, 1000, 1000);
+  }));
+
+  results.push_back(bench("cycle_orders", size, [&]{
+    sink += cycle_orders(cycle)[head];
+  }));
+
+  // find a repair that succeeds from the mid-game state, then redo it on a
+  // scratch copy every op (the copy is a flat memcpy, small next to the repair)
+  {
+    GridPath scratch_cycle = cycle;
+    Grid<int> scratch_order = cycle_order;
+    Coord a = INVALID, d = INVALID;
+    for (Coord c : dims) {
+      if (game->grid[c]) continue;
+      for (auto dir : dirs) {
+        if (!game->grid.is_clear(c + dir) || Coord(cycle[c]) == c + dir) continue;
+        std::copy(cycle.begin(), cycle.end(), scratch_cycle.begin());
+        std::copy(cycle_order.begin(), cycle_order.end(), scratch_order.begin());
+        if (repair_cycle(game->grid, scratch_cycle, c, c + dir, &scratch_order)) {
+          a = c;
+          d = c + dir;
+        }
+        if (a != INVALID) break;
+      }
+      if (a != INVALID) break;
+    }
+    if (a != INVALID) {
+      results.push_back(bench("repair_cycle", size, [&]{
+        std::copy(cycle.begin(), cycle.end(), scratch_cycle.begin());
+        std::copy(cycle_order.begin(), cycle_order.end(), scratch_order.begin());
+        repair_cycle(game->grid, scratch_cycle, a, d, &scratch_order);
+      }));
+    }
+  }
+
+  // Game::move, replaying moves recorded from an identically seeded twin so
+  // the timed loop contains no agent work
+  {
+    auto recorder = midgame(dims, 42);
+    FixedZigZagAgent agent;
+    std::vector<Dir> moves;
+    while (!recorder->done() && (int)moves.size() < 20000) {
+      Dir dir = agent(*recorder);
+      recorder->move(dir);
+      moves.push_back(dir);
+    }
+    auto replay = midgame(dims, 42);
+    size_t i = 0;
+    results.push_back(bench("Game::move", size, [&]{
+      replay->move(moves[i++]);
+    }, (long)moves.size()));
+  }
+
+  results.push_back(bench("random_free_coord", size, [&]{
+    sink += game->random_free_coord().x;
+  }));
+}
+
+//------------------------------------------------------------------------------
+// Output
+//------------------------------------------------------------------------------
+
+void write_csv(std::ostream& out, std::vector<KernelResult> const& results) {
+  using namespace std;
+  out << "size, kernel, ns/op, bytes/op, ops" << endl;
+  for (auto const& r : results) {
+    out << setw(4) << r.board_size << ", ";
+    out << left << setw(27) << r.name << ", " << right;
+    out << fixed << setprecision(1) << setw(10) << r.ns_per_op << ", ";
+    out << setprecision(0) << setw(8) << r.bytes_per_op << ", ";
+    out << setw(8) << r.ops << endl;
+  }
+}
+
+void write_json(std::ostream& out, std::vector<KernelResult> const& results) {
+  out << "[" << std::endl;
+  for (size_t i = 0; i < results.size(); ++i) {
+    auto const& r = results[i];
+    out << "  {\"kernel\": \"" << r.name << "\", \"size\": " << r.board_size;
+    out << ", \"ns_per_op\": " << r.ns_per_op;
+    out << ", \"bytes_per_op\": " << r.bytes_per_op;
+    out << ", \"ops\": " << r.ops << "}" << (i+1 < results.size() ? "," : "") << std::endl;
+  }
+  out << "]" << std::endl;
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+int main(int argc, const char** argv) {
+  bool json = false;
+  std::vector<int> sizes;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (std::strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      sizes.push_back(std::atoi(argv[++i]));
+    } else {
+      std::cerr << "Usage: snake_bench [--json] [-s <size>]..." << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (sizes.empty()) sizes = {30, 100};
+
+  std::vector<KernelResult> results;
+  for (int size : sizes) {
+    bench_kernels(size, results);
+  }
+  if (json) {
+    write_json(std::cout, results);
+  } else {
+    write_csv(std::cout, results);
+  }
+  return EXIT_SUCCESS;
+}
@@ -22,15 +22,19 @@ struct AgentLog {
   };
   
   std::vector<LogEntry> logs[(int)Key::MAX_KEY];
-  
-  template <typename T>
-  void add(int turn, Key key, T&& value) {
+
+  virtual ~AgentLog() {}
+
+  // Store an entry; entries for skipped turns are padded with NoEntry.
+  // Virtual so that a subclass can stream entries to disk instead of
+  // accumulating them in memory.
+  virtual void add(int turn, Key key, LogEntry value) {
     while ((int)logs[key].size() < turn) {
       logs[key].emplace_back(NoEntry{});
     }
-    logs[key].emplace_back(std::forward<T>(value));
+    logs[key].emplace_back(std::move(value));
   }
-  
+
   static std::string key_name(Key key) {
     if (key == cycle) return "cycles";
     if (key == plan) return "plans";
@@ -46,5 +50,10 @@ struct AgentLog {
 struct Agent {
   virtual ~Agent() {}
   virtual Dir operator () (Game const& game, AgentLog* log = nullptr) = 0;
+  // Forget all per-game state, so one instance can play round after round
+  // without being reconstructed. rng is the new round's stream, for agents
+  // that randomize their setup; a reset must draw exactly the same numbers as
+  // constructing the agent fresh, so both give identical games.
+  virtual void reset(RNG& rng) {}
 };
 
@@ -1,6 +1,9 @@
 #include "agent.hpp"
 #include "game_util.hpp"
 #include "shortest_path.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 //------------------------------------------------------------------------------
 // Agent: tree based
@@ -38,7 +41,7 @@
 // note: the returned grid is only w/2 * h/2
 // {-1,-1} indicates cell is not visited
 // {-2,-2} indicates cell is root
-Grid<CellCoord> cell_tree_parents(CoordRange dims, RingBuffer<Coord> const& snake) {
+Grid<CellCoord> cell_tree_parents(CoordRange dims, Snake const& snake) {
   Grid<CellCoord> parents(dims.w/2, dims.h/2, NOT_VISITED);
   CellCoord parent = ROOT;
   for (int i=snake.size()-1 ; i >= 0; --i) {
@@ -52,6 +55,74 @@ Grid<CellCoord> cell_tree_parents(CoordRange dims, RingBuffer<Coord> const& snak
   return parents;
 }
 
+// Incrementally maintained version of cell_tree_parents.
+// Rebuilding the parent grid walks the whole snake, which late-game is O(w*h)
+// per move; but between two moves only the head and tail cells can change.
+// The snake's segments inside one cell form at most 4 maximal runs (the cell
+// has 4 squares); per cell we keep the entry cell of each present run, oldest
+// first. The parent of a cell is then the entry cell of its oldest run, which
+// is exactly what the tail-to-head scan of cell_tree_parents computes.
+class CellTreeParents {
+public:
+  // same contents as cell_tree_parents(dims, snake) of the synced snake
+  Grid<CellCoord> parents;
+
+  CellTreeParents(CoordRange dims)
+    : parents(dims.w/2, dims.h/2, NOT_VISITED)
+    , runs(dims.w/2, dims.h/2, Runs{})
+  {}
+
+  void rebuild(Snake const& snake) {
+    std::fill(parents.begin(), parents.end(), NOT_VISITED);
+    std::fill(runs.begin(), runs.end(), Runs{});
+    CellCoord prev = ROOT; // cell of the previously scanned (more tailward) segment
+    for (int i = snake.size()-1; i >= 0; --i) {
+      CellCoord c = cell(snake[i]);
+      if (c != prev) {
+        auto& r = runs[c];
+        assert(r.num < 4);
+        r.from[r.num++] = i == snake.size()-1 ? ROOT : prev;
+        if (r.num == 1) parents[c] = r.from[0];
+      }
+      prev = c;
+    }
+  }
+
+  // the head moved from p into h
+  void push_head(Coord h, Coord p) {
+    CellCoord c = cell(h);
+    if (cell(p) == c) return; // the head's run continues
+    auto& r = runs[c];
+    assert(r.num < 4);
+    r.from[r.num++] = cell(p);
+    if (r.num == 1) parents[c] = r.from[0];
+  }
+
+  // the tail retracted from t; new_tail is the tail after the pop
+  void pop_tail(Coord t, Coord new_tail) {
+    CellCoord c = cell(t);
+    if (cell(new_tail) == c) return; // the tail's run continues
+    // the oldest run of t's cell is fully popped
+    auto& r = runs[c];
+    assert(r.num > 0);
+    r.num--;
+    for (int i = 0; i < r.num; ++i) r.from[i] = r.from[i+1];
+    parents[c] = r.num > 0 ? r.from[0] : CellCoord(NOT_VISITED);
+    // the run containing the new tail is now the oldest of the whole snake,
+    // which the tail-to-head scan labels with ROOT
+    CellCoord c2 = cell(new_tail);
+    runs[c2].from[0] = ROOT;
+    parents[c2] = ROOT;
+  }
+
+private:
+  struct Runs {
+    uint8_t num = 0;
+    CellCoord from[4]; // entry cell of each present run, oldest first
+  };
+  Grid<Runs> runs;
+};
+
 // can you move from a to b?
 bool can_move_in_cell_tree(Grid<Coord> const& cell_parents, Coord a, Coord b, Dir dir) {
   // condition 1
@@ -74,12 +145,13 @@ Dir move_to_parent(Grid<Coord> const& cell_parents, Coord a) {
 }
 
 
-Unreachables cell_tree_unreachables(GameBase const& game, Grid<Step> const& dists) {
+template <typename StepGrid>
+Unreachables cell_tree_unreachables(SearchContext& ctx, GameBase const& game, StepGrid const& dists) {
   auto cell_parents = cell_tree_parents(game.dimensions(), game.snake);
   auto can_move = [&](Coord from, Coord to, Dir dir) {
     return can_move_in_cell_tree(cell_parents, from, to, dir) && !game.grid[to];
   };
-  return unreachables(can_move, game, dists);
+  return unreachables(ctx, can_move, game, dists);
 }
 
 enum class DetourStrategy {
@@ -92,6 +164,15 @@ struct CellTreeAgent : Agent {
 public:
   // config
   bool recalculate_path = true;
+  // Verify plans on a worker thread instead of on the critical path: the move
+  // is committed as soon as A* finds a path, and the unreachability check of
+  // the planned state runs in parallel with the game taking that move. On the
+  // rare turns where the check fails, the next call drops the rest of the
+  // plan and replans with the synchronous check; by then the head has taken
+  // one step of the bad plan, which the detour logic handles like any other
+  // stale plan. Cuts single-game latency, at the cost of an occasional extra
+  // step into trouble.
+  bool speculative = false;
   Lookahead lookahead = Lookahead::many_move_tail;
   DetourStrategy detour = DetourStrategy::nearest_unreachable;
   // penalties
@@ -103,23 +184,136 @@ public:
   int open_penalty_in = 0, open_penalty_out = 0;
 
 private:
+  SearchContext ctx;
+  MoveJournal journal;
   std::vector<Coord> cached_path;
+  // parent grid maintained across moves, plus the state it was synced to
+  CellTreeParents cell_parents;
+  int prev_turn = -1;
+  int prev_size = 0;
+  Coord prev_head = INVALID;
+  Coord prev_tail = INVALID;
+
+  // Speculative verification state, shared with the worker thread. The worker
+  // is started lazily on the first speculated move and owns its own
+  // SearchContext; everything below verify_mutex is only touched under it.
+  std::thread verifier;
+  std::mutex verify_mutex;
+  std::condition_variable verify_cv;
+  bool verify_job = false;    // a snapshot is waiting to be verified
+  bool verify_quit = false;
+  bool verify_failed = false; // result of the last finished verification
+  std::unique_ptr<GameBase> verify_after; // game state after the planned path
+
+  void verifier_main() {
+    std::unique_ptr<SearchContext> wctx;
+    std::unique_lock<std::mutex> lock(verify_mutex);
+    while (true) {
+      verify_cv.wait(lock, [&]{ return verify_job || verify_quit; });
+      if (verify_quit) return;
+      GameBase const& after = *verify_after;
+      lock.unlock();
+      if (!wctx) wctx = std::make_unique<SearchContext>(after.dimensions());
+      // same check as cell_tree_unreachables, but only the yes/no answer:
+      // on failure the caller replans from scratch, so nearest/dist are unused
+      auto parents = cell_tree_parents(after.dimensions(), after.snake);
+      auto can_move = [&](Coord from, Coord to, Dir dir) {
+        return can_move_in_cell_tree(parents, from, to, dir) && !after.grid[to];
+      };
+      auto& reachable = flood_fill(*wctx, after.dimensions(), can_move, after.snake_pos());
+      reachable |= after.grid;
+      bool failed = !reachable.all();
+      lock.lock();
+      verify_failed = failed;
+      verify_job = false;
+      verify_cv.notify_all();
+    }
+  }
+
+  // wait for the in-flight verification, if any, and report whether it failed
+  bool last_plan_failed() {
+    if (!verifier.joinable()) return false;
+    std::unique_lock<std::mutex> lock(verify_mutex);
+    verify_cv.wait(lock, [&]{ return !verify_job; });
+    return verify_failed;
+  }
+
+  void start_verification(Game const& game, std::vector<Coord> const& path) {
+    // snapshot on this thread, so the game can move on while the worker checks
+    auto after = std::make_unique<GameBase>(after_moves(game, path, lookahead));
+    {
+      std::lock_guard<std::mutex> lock(verify_mutex);
+      verify_after = std::move(after);
+      verify_failed = false;
+      verify_job = true;
+    }
+    verify_cv.notify_all();
+    if (!verifier.joinable()) verifier = std::thread([this]{ verifier_main(); });
+  }
 
 public:
+  CellTreeAgent(CoordRange dims)
+    : ctx(dims)
+    , cell_parents(dims)
+  {}
+
+  ~CellTreeAgent() {
+    if (verifier.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(verify_mutex);
+        verify_quit = true;
+      }
+      verify_cv.notify_all();
+      verifier.join();
+    }
+  }
+
+  void reset(RNG&) override {
+    last_plan_failed(); // drain the verification pipeline between rounds
+    verify_failed = false;
+    cached_path.clear();
+    prev_turn = -1; // forces a cell parents rebuild on the first move
+  }
+
   Dir operator () (Game const& game, AgentLog* log = nullptr) override {
     Coord pos = game.snake_pos();
+    // Sync the cell parents: since the previous call the head advanced one
+    // square and the tail retracted at most one, so updating from those two
+    // cells replaces the O(snake) rebuild of cell_tree_parents.
+    if (game.turn == prev_turn + 1 && game.snake.size() >= 2 && Coord(game.snake[1]) == prev_head) {
+      if ((int)game.snake.size() == prev_size) cell_parents.pop_tail(prev_tail, game.snake.back());
+      cell_parents.push_head(pos, prev_head);
+    } else {
+      cell_parents.rebuild(game.snake);
+    }
+    prev_turn = game.turn;
+    prev_size = game.snake.size();
+    prev_head = pos;
+    prev_tail = game.snake.back();
+
+    // If the plan committed last turn turned out to cut part of the grid off,
+    // drop the rest of it and replan with the synchronous check this turn
+    bool replan_sync = false;
+    if (speculative && last_plan_failed()) {
+      verify_failed = false;
+      cached_path.clear();
+      replan_sync = true;
+    }
+
     if (!cached_path.empty() && !recalculate_path) {
+      PERF_COUNT(cache_hits);
       Coord pos2 = cached_path.back();
       cached_path.pop_back();
       return pos2 - pos;
     }
-    
+    PERF_COUNT(cache_misses);
+
     // Find shortest path satisfying 1,2
-    auto cell_parents = cell_tree_parents(game.dimensions(), game.snake);
+    auto const& parents = cell_parents.parents;
     auto edge = [&](Coord a, Coord b, Dir dir) {
-      if (can_move_in_cell_tree(cell_parents, a, b, dir) && !game.grid[b]) {
+      if (can_move_in_cell_tree(parents, a, b, dir) && !game.grid[b]) {
         // small penalty for moving to same/different cell
-        bool to_parent = cell(b) == cell_parents[cell(a)];
+        bool to_parent = cell(b) == parents[cell(a)];
         bool to_same   = cell(b) == cell(a);
         Dir right = rotate_clockwise(dir);
         bool hugs_edge = !game.grid.valid(b+right);
@@ -132,7 +326,12 @@ public:
         return INT_MAX;
       }
     };
-    auto dists = astar_shortest_path(game.grid.coords(), edge, pos, game.apple_pos, 1000);
+    // edge costs are bounded, so the search can use the bucket queue
+    int max_edge_cost = 1000
+      + std::max({parent_cell_penalty, same_cell_penalty, new_cell_penalty, 0})
+      + std::max({edge_penalty_in, wall_penalty_in, open_penalty_in,
+                  edge_penalty_out, wall_penalty_out, open_penalty_out, 0});
+    auto& dists = astar_shortest_path(ctx, game.grid.coords(), edge, pos, game.apple_pos, 1000, max_edge_cost);
     auto path = read_path(dists, pos, game.apple_pos);
     auto pos2 = path.back();
     
@@ -143,6 +342,9 @@ public:
     }
     
     if (pos2 == INVALID) {
+      // the apple is unreachable, so the detour below has to rescue us; that
+      // can't be deferred to the worker, since pos2 is not a committable move
+      replan_sync = true;
       if (!cached_path.empty()) {
         pos2 = cached_path.back();
       } else {
@@ -156,13 +358,22 @@ public:
     }
     
     // Heuristic 3: prevent making parts of the grid unreachable
-    if (detour != DetourStrategy::none) {
-      auto after = after_moves(game, path, lookahead);
-      auto unreachable = cell_tree_unreachables(after, dists);
+    if (detour != DetourStrategy::none && speculative && !replan_sync) {
+      // commit the move now, the worker checks the plan while it is played
+      start_verification(game, path);
+    } else if (detour != DetourStrategy::none) {
+      Unreachables unreachable;
+      {
+        // apply the path to the game itself instead of checking a copy;
+        // the simulated state has its own tree, so this rebuilds the parents
+        TemporaryMoves after(game, path, lookahead, journal);
+        unreachable = cell_tree_unreachables(ctx, game, dists);
+      }
       if (unreachable.any) {
+        PERF_COUNT(detours);
         if (log) {
           Grid<bool> unreachable_grid(game.dimensions());
-          std::transform(unreachable.reachable.begin(), unreachable.reachable.end(), unreachable_grid.begin(), [](bool r){ return !r; });
+          for (auto c : game.dimensions()) unreachable_grid[c] = !ctx.visited[c];
           log->add(game.turn, AgentLog::Key::unreachable, unreachable_grid);
         }
         if (detour == DetourStrategy::any) {
@@ -202,7 +413,148 @@ public:
     // use as new cached path
     cached_path = std::move(path);
     cached_path.pop_back();
-    
+
+    return pos2 - pos;
+  }
+};
+
+//------------------------------------------------------------------------------
+// Agent: tree based, with incremental replanning
+//------------------------------------------------------------------------------
+
+// Variant of CellTreeAgent that keeps the search state of the previous turn and
+// repairs it with D* Lite (see IncrementalAstar) instead of running
+// astar_shortest_path from scratch every move.
+// Between two consecutive turns only a few cells change: the head advances,
+// the tail retracts, and the parents of at most a few cells change. Repairing
+// around those cells is much cheaper than a full search on big boards.
+//
+// Because the incremental search runs backwards from the apple it uses a
+// uniform cost per step; the penalty knobs of CellTreeAgent are not supported.
+// Detours use strategy 3B, with a plain BFS from the head on the (rare) turns
+// where the detour actually fires, since the incremental search only knows
+// distances to the apple.
+struct IncrementalCellTreeAgent : Agent {
+public:
+  // config
+  Lookahead lookahead = Lookahead::many_move_tail;
+  bool detour = true;
+
+private:
+  IncrementalAstar search;
+  SearchContext ctx;
+  MoveJournal journal;
+  Grid<CellCoord> prev_parents;
+  Coord prev_tail = INVALID;
+
+public:
+  IncrementalCellTreeAgent(CoordRange dims)
+    : search(dims, 1000)
+    , ctx(dims)
+    , prev_parents(dims.w/2, dims.h/2, NOT_VISITED)
+  {}
+
+  void reset(RNG&) override {
+    search.reset();
+    prev_tail = INVALID;
+  }
+
+  Dir operator () (Game const& game, AgentLog* log = nullptr) override {
+    Coord pos = game.snake_pos();
+    auto cell_parents = cell_tree_parents(game.dimensions(), game.snake);
+    auto edge = [&](Coord a, Coord b, Dir dir) {
+      if (can_move_in_cell_tree(cell_parents, a, b, dir) && !game.grid[b]) {
+        return 1000;
+      } else {
+        return INT_MAX;
+      }
+    };
+
+    if (search.goal() != game.apple_pos) {
+      // first turn or a new apple: start a fresh search
+      search.new_goal(pos, game.apple_pos);
+    } else {
+      search.move_start(pos);
+      // repair around the cells whose edges changed since last turn:
+      // the head advanced, the tail may have retracted, ...
+      search.update_edges_near(edge, pos);
+      if (prev_tail != INVALID && !game.grid[prev_tail]) {
+        search.update_edges_near(edge, prev_tail);
+      }
+      // ... and some cells may have a different parent in the tree
+      for (Coord c : prev_parents.coords()) {
+        if (cell_parents[c] != prev_parents[c]) {
+          Coord base = {c.x*2, c.y*2};
+          search.update_edges_near(edge, base);
+          search.update_edges_near(edge, {base.x+1, base.y+1});
+        }
+      }
+    }
+    search.replan(edge);
+    std::copy(cell_parents.begin(), cell_parents.end(), prev_parents.begin());
+    prev_tail = game.snake.back();
+
+    auto path = search.reachable() ? search.read_path(edge) : std::vector<Coord>();
+    if (path.empty()) {
+      // No tree-respecting path to the apple.
+      // Retrace our steps towards the tail until the apple opens up again.
+      for (auto dir : dirs) {
+        if (game.grid.valid(pos+dir) && edge(pos, pos+dir, dir) != INT_MAX) return dir;
+      }
+      return move_to_parent(cell_parents, pos);
+    }
+    Coord pos2 = path.back();
+
+    if (log) {
+      auto path_copy = path;
+      path_copy.push_back(pos);
+      log->add(game.turn, AgentLog::Key::plan, std::move(path_copy));
+    }
+
+    // Heuristic 3B: prevent making parts of the grid unreachable
+    if (detour) {
+      bool any_unreachable = false;
+      {
+        // apply the path to the game itself instead of checking a copy;
+        // ctx.visited ends up with the cells reachable (or occupied) in the
+        // state after the moves
+        TemporaryMoves after(game, path, lookahead, journal);
+        auto after_parents = cell_tree_parents(game.dimensions(), game.snake);
+        auto can_move = [&](Coord from, Coord to, Dir dir) {
+          return can_move_in_cell_tree(after_parents, from, to, dir) && !game.grid[to];
+        };
+        auto& reachable = flood_fill(ctx, game.dimensions(), can_move, game.snake_pos());
+        reachable |= game.grid;
+        any_unreachable = !reachable.all();
+      }
+      if (any_unreachable) {
+        PERF_COUNT(detours);
+        if (log) {
+          Grid<bool> unreachable_grid(game.dimensions());
+          for (auto c : game.dimensions()) unreachable_grid[c] = !ctx.visited[c];
+          log->add(game.turn, AgentLog::Key::unreachable, unreachable_grid);
+        }
+        // move to the nearest unreachable coord first
+        // (the edges here are those of the current state, before the moves)
+        auto& dists = generic_shortest_path(ctx, game.dimensions(), [&](Coord a, Coord b, Dir dir) {
+          return edge(a,b,dir) != INT_MAX;
+        }, pos);
+        Coord nearest = INVALID;
+        int dist_to_nearest = INT_MAX;
+        for (auto a : game.grid.coords()) {
+          if (!ctx.visited[a] && dists[a].dist < dist_to_nearest) {
+            nearest = a;
+            dist_to_nearest = dists[a].dist;
+          }
+        }
+        if (dist_to_nearest < INT_MAX) {
+          pos2 = first_step(dists, pos, nearest);
+          return pos2 - pos;
+        }
+        // failed to find a detour, continue along the planned path
+      }
+    }
+
     return pos2 - pos;
   }
 };
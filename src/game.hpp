@@ -9,13 +9,15 @@
 // Game state
 //------------------------------------------------------------------------------
 
-using Snake = RingBuffer<Coord>;
+// Snake segments are stored packed; 4 bytes per segment instead of 8 makes
+// the per-move lookahead copies in after_moves half as big.
+using Snake = RingBuffer<Coord16>;
 
 // State of a game of snake, without tracking anything else
 class GameBase {
 public:
   // Grid: true = contains part of the snake, false = empty
-  Grid<bool> grid;
+  BitGrid grid;
   // Coordinates that contain the snake, front = head of snake, back = tail of snake
   Snake snake;
   // Coordinate of the next goal/apple
@@ -57,12 +59,22 @@ public:
   
   Game(CoordRange dimensions, RNG const& rng = global_rng.next_rng());
   Game(Game const&) = delete;
+  // restart in place, reusing the allocated grids (see LockstepRunner)
+  void reset(RNG const& rng);
   Event move(Dir dir);
+  // draw a random cell not covered by the snake (used for apple placement)
+  Coord random_free_coord();
 
 private:
   RNG rng;
-  
-  Coord random_free_coord();
+  // Dense index of the free cells, so that apple placement is O(1):
+  // free_cells holds every coord not covered by the snake, in arbitrary order,
+  // and free_index[c] is the position of c in free_cells (or -1 when occupied).
+  std::vector<Coord> free_cells;
+  Grid<int> free_index;
+
+  void occupy(Coord c);
+  void vacate(Coord c);
 };
 
 std::ostream& operator << (std::ostream& out, Game const& game);
@@ -76,23 +88,56 @@ std::ostream& operator << (std::ostream& out, Game const& game);
 Game::Game(CoordRange dims, RNG const& base_rng)
   : GameBase(dims)
   , rng(base_rng)
+  , free_index(dims, -1)
 {
+  free_cells.reserve(dims.size());
+  for (auto c : dims) {
+    vacate(c);
+  }
   Coord start = dims.random(rng);
   snake.push_front(start);
   grid[start] = true;
+  occupy(start);
   apple_pos = random_free_coord();
 }
 
-Coord Game::random_free_coord() {
-  int n = grid.size() - snake.size();
-  int pos = rng.random(n);
-  for (auto c : grid.coords()) {
-    if (!grid[c]) {
-      if (pos == 0) return c;
-      else pos--;
-    }
+// Equivalent to constructing Game(dimensions(), base_rng), but without any
+// allocation, so one Game object can be recycled for round after round.
+void Game::reset(RNG const& base_rng) {
+  turn = 0;
+  state = State::playing;
+  rng = base_rng;
+  grid.clear();
+  snake.clear();
+  free_cells.clear();
+  for (auto c : dimensions()) {
+    vacate(c);
   }
-  throw "no free coord";
+  Coord start = dimensions().random(rng);
+  snake.push_front(start);
+  grid[start] = true;
+  occupy(start);
+  apple_pos = random_free_coord();
+}
+
+// swap-remove c from the free cell index
+void Game::occupy(Coord c) {
+  int i = free_index[c];
+  Coord last = free_cells.back();
+  free_cells[i] = last;
+  free_index[last] = i;
+  free_cells.pop_back();
+  free_index[c] = -1;
+}
+
+void Game::vacate(Coord c) {
+  free_index[c] = (int)free_cells.size();
+  free_cells.push_back(c);
+}
+
+Coord Game::random_free_coord() {
+  if (free_cells.empty()) throw "no free coord";
+  return free_cells[rng.random((int)free_cells.size())];
 }
 
 Game::Event Game::move(Dir dir) {
@@ -112,6 +157,7 @@ Game::Event Game::move(Dir dir) {
   // move
   snake.push_front(next);
   grid[next] = true;
+  occupy(next);
   if (next == apple_pos) {
     // grow
     if (snake.size() == grid.size()) {
@@ -123,6 +169,7 @@ Game::Event Game::move(Dir dir) {
   } else {
     // remove tail
     grid[snake.back()] = false;
+    vacate(snake.back());
     snake.pop_back();
     return Event::move;
   }
@@ -241,3 +288,11 @@ std::ostream& operator << (std::ostream& out, Grid<bool> const& grid) {
   return out << vis;
 }
 
+std::ostream& operator << (std::ostream& out, BitGrid const& grid) {
+  Grid<std::string> vis(grid.dimensions());
+  for (auto c : grid.coords()) {
+    vis[c] = grid[c] ? "#" : ".";
+  }
+  return out << vis;
+}
+
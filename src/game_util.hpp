@@ -36,6 +36,69 @@ GameBase after_moves(GameBase const& game, std::vector<Coord> const& path, Looka
   return after;
 }
 
+// Journal of the cells touched by a TemporaryMoves lookahead. Keep one
+// instance around between moves and reuse it, so lookahead doesn't allocate.
+struct MoveJournal {
+  int pushed = 0;
+  std::vector<Coord> popped; // one entry per pushed cell, INVALID if no pop
+};
+
+// In-place version of after_moves: applies the path to the game itself and
+// rolls it back in the destructor, so a lookahead touches O(path length)
+// memory instead of deep-copying the whole board. The game is back in its
+// exact previous state when the lookahead goes out of scope, which is why it
+// may borrow a const game.
+class TemporaryMoves {
+private:
+  GameBase& game;
+  MoveJournal& journal;
+
+public:
+  TemporaryMoves(GameBase const& game, std::vector<Coord> const& path, Lookahead lookahead, MoveJournal& journal)
+    : game(const_cast<GameBase&>(game)), journal(journal)
+  {
+    journal.pushed = 0;
+    journal.popped.clear();
+    assert(is_neighbor(path.back(), game.snake_pos()));
+    bool move_tail = lookahead == Lookahead::many_move_tail;
+    if (lookahead == Lookahead::one) {
+      push(path.back(), false);
+    } else {
+      for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        push(*it, move_tail);
+      }
+    }
+  }
+
+  ~TemporaryMoves() {
+    // undo in exact reverse order: with a short snake the same cell can be
+    // both popped and pushed (or pushed and popped) by one lookahead
+    for (int i = journal.pushed-1; i >= 0; --i) {
+      Coord p = journal.popped[i];
+      if (p != INVALID) {
+        game.grid[p] = true;
+        game.snake.push_back(p);
+      }
+      game.grid[game.snake.front()] = false;
+      game.snake.pop_front();
+    }
+  }
+
+private:
+  void push(Coord p, bool move_tail) {
+    game.grid[p] = true;
+    game.snake.push_front(p);
+    Coord popped = INVALID;
+    if (move_tail && p != game.apple_pos) {
+      popped = game.snake.back();
+      game.grid[popped] = false;
+      game.snake.pop_back();
+    }
+    journal.pushed++;
+    journal.popped.push_back(popped);
+  }
+};
+
 //------------------------------------------------------------------------------
 // Unreachable parts of the grid
 //------------------------------------------------------------------------------
@@ -44,35 +107,98 @@ struct Unreachables {
   bool any = false;
   Coord nearest = {-1,-1};
   int dist_to_nearest = INT_MAX;
-  Grid<bool> reachable;
-  
-  Unreachables(Grid<bool> const& reachable)
-    : reachable(reachable)
-  {}
 };
 
 // Find parts of the grid that are unreachable from the snake's position
 // Usually used with after_moves()
+// The reachable cells end up in ctx.visited, in case the caller needs them.
 //
 // Note: this is not exactly the same as the snake splitting the grid into two (or more) parts
-template <typename CanMove, typename GameLike>
-Unreachables unreachables(CanMove can_move, GameLike const& game, Grid<Step> const& dists) {
+template <typename CanMove, typename GameLike, typename StepGrid>
+Unreachables unreachables(SearchContext& ctx, CanMove can_move, GameLike const& game, StepGrid const& dists) {
   // are there unreachable coords?
-  Unreachables out = flood_fill(game.dimensions(), can_move, game.snake_pos());
+  auto& reachable = flood_fill(ctx, game.dimensions(), can_move, game.snake_pos());
+  reachable |= game.grid; // count grid cells containing the snake as reachable
+  Unreachables out;
+  if (reachable.all()) return out; // common case, checked word-parallel
+  out.any = true;
   for (auto a : game.grid.coords()) {
-    if (game.grid[a]) {
-      out.reachable[a] = true; // count grid cells containing the snake as reachable
-    } else if (!out.reachable[a]) {
-      out.any = true;
-      if (dists[a].dist < out.dist_to_nearest) {
-        out.nearest = a;
-        out.dist_to_nearest = dists[a].dist;
-      }
+    if (!reachable[a] && dists[a].dist < out.dist_to_nearest) {
+      out.nearest = a;
+      out.dist_to_nearest = dists[a].dist;
     }
   }
   return out;
 }
 
+//------------------------------------------------------------------------------
+// Incremental connectivity
+//------------------------------------------------------------------------------
+
+// Does occupying cell c keep the free cells around it connected to each other?
+// Occupying c can only disconnect cells that were connected through c, and any
+// path through c can be rerouted through the ring of 8 cells around it. So the
+// free 4-neighbors of c stay connected iff they lie in a single contiguous arc
+// of free cells in that ring (cells outside the grid count as occupied).
+// This makes it an O(1) articulation test for the free region.
+inline bool occupy_keeps_connected(BitGrid const& grid, Coord c) {
+  // ring around c in clockwise order, starting at the top; even indices are
+  // the 4-neighbors
+  const Coord ring[8] = {
+    {c.x,c.y-1}, {c.x+1,c.y-1}, {c.x+1,c.y}, {c.x+1,c.y+1},
+    {c.x,c.y+1}, {c.x-1,c.y+1}, {c.x-1,c.y}, {c.x-1,c.y-1},
+  };
+  bool free_cell[8];
+  int start = -1;
+  for (int i = 0; i < 8; ++i) {
+    free_cell[i] = grid.is_clear(ring[i]);
+    if (!free_cell[i]) start = i;
+  }
+  if (start == -1) return true; // the whole ring is free
+  // walk the ring from an occupied cell so arcs don't wrap around
+  int side_arc = -1, arc = -1;
+  bool prev_free = false;
+  for (int j = 1; j <= 8; ++j) {
+    int i = (start + j) % 8;
+    if (free_cell[i]) {
+      if (!prev_free) arc++;
+      if (i % 2 == 0) {
+        if (side_arc == -1) side_arc = arc;
+        else if (side_arc != arc) return false;
+      }
+    }
+    prev_free = free_cell[i];
+  }
+  return true;
+}
+
+// Fast check that following `path` (in read_path order) leaves no free cell
+// unreachable, by applying occupy_keeps_connected to each newly occupied cell
+// one at a time instead of flood filling the whole board.
+// Returns false when inconclusive, in which case the caller should fall back
+// to after_moves + unreachables. Lookahead::many_move_tail always falls back:
+// freed tail cells can form new regions that this test does not see.
+// Note: this only looks at plain grid connectivity, it cannot replace
+// cell_tree_unreachables, whose movement rules are direction dependent.
+template <typename GameLike>
+bool moves_keep_reachable(SearchContext& ctx, GameLike const& game, std::vector<Coord> const& path, Lookahead lookahead) {
+  if (lookahead == Lookahead::many_move_tail) return false;
+  // ctx.visited is free as scratch space here: on fallback the flood fill in
+  // unreachables() clears it again before use
+  BitGrid& work = ctx.visited;
+  work.clear();
+  work |= game.grid;
+  if (lookahead == Lookahead::one) {
+    return occupy_keeps_connected(work, path.back());
+  }
+  for (auto it = path.rbegin(); it != path.rend(); ++it) {
+    if (work[*it]) continue;
+    if (!occupy_keeps_connected(work, *it)) return false;
+    work[*it] = true;
+  }
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // Cell moves
 //------------------------------------------------------------------------------
@@ -122,7 +248,8 @@ inline constexpr CellCoord cell(Coord c) {
 //------------------------------------------------------------------------------
 
 // A Hamiltonian cycle represented as: at each grid point the coordinate of the next point
-using GridPath = Grid<Coord>;
+// (packed, so a cycle is 4 bytes per cell)
+using GridPath = Grid<Coord16>;
 
 bool is_hamiltonian_cycle(GridPath const& path) {
   // conditions:
@@ -201,6 +328,18 @@ int path_distane(GridPath const& path, Coord from, Coord to) {
   return dist;
 }
 
+// Position of each coord along the cycle, counted from an arbitrary origin.
+// The distance from a to b along the cycle is (order[b] - order[a]) mod size.
+Grid<int> cycle_orders(GridPath const& cycle) {
+  Grid<int> order(cycle.dimensions(), -1);
+  Coord c = {0,0};
+  for (int i=0; i<cycle.size(); ++i) {
+    order[c] = i;
+    c = cycle[c];
+  }
+  return order;
+}
+
 GridPath reverse(GridPath const& path) {
   GridPath reverse(path.dimensions(), INVALID);
   for (auto pos : path.coords()) {
@@ -1,6 +1,25 @@
 #include "agent.hpp"
 #include "game_util.hpp"
 #include "shortest_path.hpp"
+#include <memory>
+
+//------------------------------------------------------------------------------
+// Shared cycles
+//------------------------------------------------------------------------------
+
+// A Hamiltonian cycle together with its order labels. Both are immutable, so
+// one copy can be built per campaign and shared read-only by every round on
+// every thread (see Config::zig_zag_cycle), instead of each round re-deriving
+// the order grid from scratch.
+struct SharedCycle {
+  GridPath cycle;
+  Grid<int> order;
+
+  SharedCycle(GridPath cycle)
+    : cycle(std::move(cycle))
+    , order(cycle_orders(this->cycle))
+  {}
+};
 
 //------------------------------------------------------------------------------
 // Perturbated Hamiltonian Cycle algorithm
@@ -12,21 +31,20 @@ public:
   const bool use_shortest_path = false;
 
 private:
-  GridPath cycle;
-  Grid<int> cycle_order;
+  std::shared_ptr<SharedCycle const> data; // never mutated, only followed
+  GridPath const& cycle;
+  Grid<int> const& cycle_order;
 
 public:
+  PerturbedHamiltonianCycle(std::shared_ptr<SharedCycle const> data)
+    : data(std::move(data))
+    , cycle(this->data->cycle)
+    , cycle_order(this->data->order)
+  {}
   PerturbedHamiltonianCycle(GridPath const& cycle)
-    : cycle(cycle)
-    , cycle_order(cycle.dimensions(), -1)
-  {
-    Coord c = {0,0};
-    for (int i=0; i<cycle.size(); ++i) {
-      cycle_order[c] = i;
-      c = cycle[c];
-    }
-  }
-  
+    : PerturbedHamiltonianCycle(std::make_shared<SharedCycle>(cycle))
+  {}
+
   int cycle_distance(Coord a, Coord b) const {
     int order_a = cycle_order[a];
     int order_b = cycle_order[b];
@@ -79,7 +97,7 @@ public:
             return INT_MAX;
           }
         };
-        Coord to = dist_goal < dist_tail ? goal : game.snake.back();
+        Coord to = dist_goal < dist_tail ? goal : Coord(game.snake.back());
         auto paths = astar_shortest_path(game.grid.coords(), edge, pos, to);
         Coord better_next = first_step(paths, pos, to);
         if (game.grid.is_clear(better_next)) {
@@ -119,10 +137,13 @@ public:
 // Change a Hamiltonian cycle to have next[a] == d
 // patches up the path so it remains a cycle
 // returns success
-bool repair_cycle(Grid<bool> const& grid, GridPath& next, Coord a, Coord d) {
+// If cycle_order is given it holds the position of each coord along the cycle
+// (see cycle_orders below), and is patched to match the rewired cycle.
+bool repair_cycle(BitGrid const& grid, GridPath& next, Coord a, Coord d, Grid<int>* cycle_order = nullptr) {
   assert(is_neighbor(a,d));
   assert(is_hamiltonian_cycle(next));
   if (next[a] == d) return true; // already done
+  PERF_COUNT(repair_attempts);
   // Path is [...,a,b,...,c,d,...]
   Coord b = next[a];
   Coord c = path_from(next, d);
@@ -131,7 +152,7 @@ bool repair_cycle(Grid<bool> const& grid, GridPath& next, Coord a, Coord d) {
   if (is_neighbor(b,c)) {
     // [c,b,...] is also 
     // Mark cycle of nodes except those between a and d, call that cycle1
-    Grid<bool> cycle1(grid.dimensions(),false);
+    BitGrid cycle1(grid.dimensions(),false);
     for (Coord x = d; x != a; x = next[x]) {
       assert(!cycle1[x]);
       cycle1[x] = true;
@@ -147,6 +168,7 @@ bool repair_cycle(Grid<bool> const& grid, GridPath& next, Coord a, Coord d) {
     //  * do not currently contain the snake
     //  * are after the goal(?)
     for (Coord x=b; x!=c; x=next[x]) {
+      PERF_COUNT(repair_cells);
       Coord y = next[x];
       Dir xy = y-x;
       for (Dir dir : {rotate_clockwise(xy), rotate_counter_clockwise(xy)}) {
@@ -168,12 +190,40 @@ bool repair_cycle(Grid<bool> const& grid, GridPath& next, Coord a, Coord d) {
           g[v] = yellow("v");
           std::cout << g;
           */
-          next[a] = d;
-          next[c] = b;
-          next[x] = v;
-          next[u] = y;
+          if (cycle_order) {
+            // Patch the order labels for the rewired cycle a,d..u,y..c,b..x,v..a.
+            // Each segment keeps its internal order, so it suffices to walk
+            // forward from the end of one fixed segment and relabel until the
+            // labels rejoin. Segment sizes follow from the old labels, so we
+            // can keep whichever of the two long segments (d..u or v..a)
+            // relabels the least.
+            auto& order = *cycle_order;
+            const int size = order.size();
+            auto between = [&](Coord p, Coord q) { return (order[q] - order[p] + size) % size; };
+            int s1 = between(b,x) + 1;
+            int s2 = between(y,c) + 1;
+            int s3 = between(d,u) + 1;
+            int s4 = size - 1 - s1 - s2 - s3; // v..a, excluding a itself
+            next[a] = d;
+            next[c] = b;
+            next[x] = v;
+            next[u] = y;
+            Coord start = s3 > s4 + 1 ? u : a;
+            int n       = s3 > s4 + 1 ? s1 + s2 + s4 + 1 : s1 + s2 + s3;
+            int o = order[start];
+            for (Coord p = next[start]; n --> 0; p = next[p]) {
+              o = o + 1 == size ? 0 : o + 1;
+              order[p] = o;
+            }
+          } else {
+            next[a] = d;
+            next[c] = b;
+            next[x] = v;
+            next[u] = y;
+          }
           //std::cout << draw_cycle(next, yellow);
           assert(is_hamiltonian_cycle(next));
+          PERF_COUNT(repair_successes);
           return true;
         }
       }
@@ -191,63 +241,92 @@ bool repair_cycle(Grid<bool> const& grid, GridPath& next, Coord a, Coord d) {
   return false;
 }
 
-Grid<int> cycle_distances(GridPath cycle, Coord goal) {
-  Grid<int> dists(cycle.dimensions());
-  Coord c = goal;
-  int dist = cycle.size()-1;
-  do {
-    c = cycle[c];
-    dists[c] = dist--;
-  } while (c != goal);
-  return dists;
-}
-
 struct DynamicHamiltonianCycleRepair : Agent {
+  std::shared_ptr<SharedCycle const> initial; // pristine cycle, restored by reset()
   GridPath cycle;
+  Grid<int> cycle_order; // position along the cycle, patched by repair_cycle
   bool recalculate_path = true;
   int wall_follow_overshoot = 0; // 0 to disable
   int wall_follow_mode = 0;
+  bool hierarchical = false; // restrict the search to an HPA* corridor
+  SearchContext ctx;
+  HierarchicalPathfinder hier;
+  MoveJournal journal;
   std::vector<Coord> cached_path;
-  
-  DynamicHamiltonianCycleRepair(GridPath const& cycle) : cycle(cycle) {}
-  
+
+  DynamicHamiltonianCycleRepair(std::shared_ptr<SharedCycle const> shared)
+    : initial(std::move(shared))
+    , cycle(initial->cycle)
+    , cycle_order(initial->order)
+    , ctx(cycle.dimensions())
+    , hier(cycle.dimensions())
+  {}
+  DynamicHamiltonianCycleRepair(GridPath const& cycle)
+    : DynamicHamiltonianCycleRepair(std::make_shared<SharedCycle>(cycle))
+  {}
+
+  void reset(RNG&) override {
+    std::copy(initial->cycle.begin(), initial->cycle.end(), cycle.begin());
+    std::copy(initial->order.begin(), initial->order.end(), cycle_order.begin());
+    wall_follow_mode = 0;
+    cached_path.clear();
+  }
+
   Dir operator () (Game const& game, AgentLog* log = nullptr) override {
     Coord pos = game.snake_pos();
     Coord goal = game.apple_pos;
     // use cache?
     if (!cached_path.empty() && !recalculate_path) {
+      PERF_COUNT(cache_hits);
       Coord pos2 = cached_path.back();
       cached_path.pop_back();
       return pos2 - pos;
     }
-    // distance to goal along current cycle
-    auto cycle_distance = cycle_distances(cycle, goal);
+    PERF_COUNT(cache_misses);
+    // distance to goal along the current cycle: re-anchoring the maintained
+    // order labels to the goal is an O(1) offset instead of a full cycle walk
+    const int cycle_size = cycle_order.size();
+    const int goal_order = cycle_order[goal];
+    auto cycle_distance = [&](Coord c) {
+      return (goal_order - cycle_order[c] + cycle_size) % cycle_size;
+    };
     // find path to goal
     auto can_move = [&](Coord from, Coord to, Dir) {
       return !game.grid[to];
     };
     auto edge = [&](Coord from, Coord to, Dir dir) {
-      return can_move(from,to,dir) ? 1000000 + cycle_distance[to] : INT_MAX;
+      return can_move(from,to,dir) ? 1000000 + cycle_distance(to) : INT_MAX;
     };
-    auto dists = astar_shortest_path(game.grid.coords(), edge, pos, goal, 1000000);
+    // On large boards the full-board search dominates the move time; the
+    // hierarchical mode plans through an HPA* corridor instead.
+    auto& dists = hierarchical
+      ? hierarchical_shortest_path(ctx, hier, game.grid, edge, pos, goal, 1000000)
+      : astar_shortest_path(ctx, game.grid.coords(), edge, pos, goal, 1000000);
     auto path = read_path(dists, pos, goal);
     Coord target = path.back();
     // wall follow/nascar mode
     // I don't understand what the code is trying to do exactly
     if (wall_follow_overshoot > 0) {
       // would this path make nodes unreachable?
-      auto after = after_moves(game, path, Lookahead::many_keep_tail);
-      auto can_move_after = [&](Coord from, Coord to, Dir) {
-        return !after.grid[to];
-      };
-      auto unreachable = unreachables(can_move_after, after, dists);
-      if (unreachable.any) {
+      // usually the O(path) local connectivity test settles this; only when it
+      // is inconclusive do we build the lookahead state and flood fill
+      bool any_unreachable = false;
+      if (!moves_keep_reachable(ctx, game, path, Lookahead::many_keep_tail)) {
+        // apply the path to the game itself instead of flood filling a copy
+        TemporaryMoves after(game, path, Lookahead::many_keep_tail, journal);
+        auto can_move_after = [&](Coord from, Coord to, Dir) {
+          return !game.grid[to];
+        };
+        any_unreachable = unreachables(ctx, can_move_after, game, dists).any;
+      }
+      if (any_unreachable) {
+        PERF_COUNT(detours);
         wall_follow_mode = wall_follow_overshoot; // called nascar mode in original code;
       } else if (wall_follow_mode) {
         wall_follow_mode--;
       }
       if (wall_follow_mode > 0) {
-        Coord prev = game.snake.size() <= 1 ? pos + Dir::down : game.snake[1];
+        Coord prev = game.snake.size() <= 1 ? pos + Dir::down : Coord(game.snake[1]);
         Dir last_dir = pos - prev;
         // always go clockwise/counterclockwise
         Dir turn = rotate_clockwise(last_dir);
@@ -272,7 +351,7 @@ struct DynamicHamiltonianCycleRepair : Agent {
     bool changed_cycle = game.turn == 0;
     if (cycle[pos] != target) {
       // cycle needs to be changed
-      if (!repair_cycle(game.grid, cycle, pos, target)) {
+      if (!repair_cycle(game.grid, cycle, pos, target, &cycle_order)) {
         // Failed to repair, continue along previous cycle
       } else {
         changed_cycle = true;
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+
+//------------------------------------------------------------------------------
+// Hot path instrumentation counters
+//------------------------------------------------------------------------------
+
+// Cheap counters for the work done on the hot paths, to tell where a slow run
+// spends its moves (search expansions? flood fills? detours?) without
+// attaching a profiler. Counting costs a single thread-local increment;
+// compile with -DSNAKE_NO_PERF_COUNTERS to turn every PERF_COUNT into a no-op.
+
+struct PerfCounters {
+  uint64_t astar_expanded = 0;   // nodes expanded by the shortest path searches
+  uint64_t flood_cells = 0;      // cells marked by flood_fill
+  uint64_t repair_attempts = 0;  // repair_cycle calls that had to rewire
+  uint64_t repair_successes = 0; //  ... that found a rewiring
+  uint64_t repair_cells = 0;     //  ... path nodes scanned while looking for one
+  uint64_t cache_hits = 0;       // moves taken from a cached path
+  uint64_t cache_misses = 0;     // moves that needed a new search
+  uint64_t detours = 0;          // detour activations (path would cut off cells)
+
+  void operator += (PerfCounters const& that) {
+    astar_expanded   += that.astar_expanded;
+    flood_cells      += that.flood_cells;
+    repair_attempts  += that.repair_attempts;
+    repair_successes += that.repair_successes;
+    repair_cells     += that.repair_cells;
+    cache_hits       += that.cache_hits;
+    cache_misses     += that.cache_misses;
+    detours          += that.detours;
+  }
+
+  // hand over the accumulated counts, resetting to zero
+  PerfCounters take() {
+    PerfCounters out = *this;
+    *this = PerfCounters();
+    return out;
+  }
+
+  bool any() const {
+    return (astar_expanded | flood_cells | repair_attempts | repair_successes |
+            repair_cells | cache_hits | cache_misses | detours) != 0;
+  }
+};
+
+// Counters of the current thread. Games are played to completion on one
+// thread, so taking these right after a game yields that game's counts.
+inline thread_local PerfCounters perf_counters;
+
+#ifndef SNAKE_NO_PERF_COUNTERS
+#define PERF_COUNT(field) ((void)++perf_counters.field)
+#define PERF_COUNT_N(field, n) ((void)(perf_counters.field += (n)))
+#else
+#define PERF_COUNT(field) ((void)0)
+#define PERF_COUNT_N(field, n) ((void)0)
+#endif
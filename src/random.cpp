@@ -102,6 +102,30 @@ void RNG::long_jump() {
 	s[1] = s1;
 }
 
+/* splitmix64, the seeding generator recommended by the xoroshiro authors.
+   Written in 2015 by Sebastiano Vigna (vigna@acm.org), public domain. */
+
+static inline uint64_t splitmix64(uint64_t& x) {
+	uint64_t z = (x += 0x9e3779b97f4b7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+RNG RNG::stream_rng(uint64_t i) const {
+	// Keyed derivation: run splitmix64 on the stream index, with the state
+	// words folded in between the two outputs. Each output is a full
+	// avalanche mix, so consecutive indices give unrelated xoroshiro seeds.
+	uint64_t x = i ^ s[0];
+	uint64_t t[2];
+	t[0] = splitmix64(x);
+	x ^= s[1];
+	t[1] = splitmix64(x);
+	// xoroshiro state must not be everywhere zero
+	if ((t[0] | t[1]) == 0) t[0] = 1;
+	return RNG(t);
+}
+
 // -----------------------------------------------------------------------------
 // Global rng
 // -----------------------------------------------------------------------------
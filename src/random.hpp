@@ -18,6 +18,9 @@ public:
   void jump();
   void long_jump();
 
+  // raw state, for serialization (e.g. campaign checkpoint files)
+  inline uint64_t state(int i) const { return s[i]; }
+
   inline uint64_t random(uint64_t range) {
     // TODO: make sure range evenly divides 2^64
     return next() % range;
@@ -33,6 +36,12 @@ public:
     return out;
   }
 
+  // Counter-based splitting: the rng for stream i is a pure function of the
+  // current state and i, without mutating anything. Unlike repeated
+  // next_rng() calls this needs no lock and no pre-splitting to hand out the
+  // same stream to round i at any thread count (or on any shard).
+  RNG stream_rng(uint64_t i) const;
+
   // for compatability with keyed RNG
   template <typename Key>
   inline int random(int n, Key key) {
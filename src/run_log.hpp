@@ -0,0 +1,525 @@
+#pragma once
+
+#include "game.hpp"
+#include "agent.hpp"
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+// Streaming binary run log
+//------------------------------------------------------------------------------
+
+// A binary log of a single game, written incrementally while the game is
+// played. Unlike the in-memory Log/AgentLog + json path, memory use stays
+// O(board) no matter how long the game runs: every record is flushed through
+// a large stream buffer as soon as it is produced.
+// Use `snake convert` to turn a run log into the json format for visualize/.
+//
+// Since version 2 the log doubles as a seekable replay container: a keyframe
+// with the full game state is recorded every RUN_LOG_KEYFRAME_INTERVAL turns,
+// and a footer indexes the keyframes by file offset. ReplayReader below
+// memory-maps the file and uses the index to reconstruct the state at any
+// turn in O(keyframe interval + snake length), instead of decoding the moves
+// from the start of a 100k-turn game.
+//
+// Format (all integers little endian):
+//   header: "SNKL", u8 version,
+//           u8-length-prefixed agent name and description,
+//           u16 w, h, start x,y, apple x,y, u32 keyframe interval
+//   records, each starting with a tag byte:
+//     'm'  u8 (dir | event<<2)                    one per turn
+//     'a'  u16 x,y                                new apple pos, after an eat
+//     'k'  u32 turn, u16 apple x,y,
+//          u32 n, n x u16 x,y                     keyframe: snake, head first
+//     'p'  u8 key, u32 turn, path                 agent log path (e.g. a plan)
+//     'g'  u8 key, u32 turn, bit-packed grid      agent log grid
+//     'c'  u8 key, u32 turn                       agent log copy-of-previous
+//     'e'  u32 turns, u8 win                      final record
+//   footer: u32 k, k x u64 keyframe file offsets (keyframe i holds the state
+//           after i*interval turns; offset 0 points at the first record, for
+//           the initial state), u32 turns, u8 win,
+//           u64 offset of the footer itself, "SNKI"
+//   a path is: u32 n, u8 mode; mode 1 is a u16 x,y start followed by n-1
+//   deltas of 2 bits each (like the json path encoding), mode 0 is n raw
+//   u16 x,y pairs for the rare non-contiguous path.
+
+const char RUN_LOG_MAGIC[4] = {'S','N','K','L'};
+const char RUN_LOG_INDEX_MAGIC[4] = {'S','N','K','I'};
+const uint8_t RUN_LOG_VERSION = 2;
+const int RUN_LOG_KEYFRAME_INTERVAL = 1024;
+
+inline void write_u8(std::ostream& out, uint8_t x) {
+  out.put((char)x);
+}
+inline void write_u16(std::ostream& out, uint16_t x) {
+  out.put((char)(x & 0xff));
+  out.put((char)(x >> 8));
+}
+inline void write_u32(std::ostream& out, uint32_t x) {
+  write_u16(out, (uint16_t)(x & 0xffff));
+  write_u16(out, (uint16_t)(x >> 16));
+}
+inline void write_u64(std::ostream& out, uint64_t x) {
+  write_u32(out, (uint32_t)(x & 0xffffffff));
+  write_u32(out, (uint32_t)(x >> 32));
+}
+inline void write_coord_u16(std::ostream& out, Coord c) {
+  write_u16(out, (uint16_t)c.x);
+  write_u16(out, (uint16_t)c.y);
+}
+inline void write_short_string(std::ostream& out, std::string const& s) {
+  write_u8(out, (uint8_t)std::min<size_t>(s.size(), 255));
+  out.write(s.data(), std::min<size_t>(s.size(), 255));
+}
+
+inline uint8_t read_u8(std::istream& in) {
+  return (uint8_t)in.get();
+}
+inline uint16_t read_u16(std::istream& in) {
+  uint16_t lo = read_u8(in);
+  return lo | (uint16_t)read_u8(in) << 8;
+}
+inline uint32_t read_u32(std::istream& in) {
+  uint32_t lo = read_u16(in);
+  return lo | (uint32_t)read_u16(in) << 16;
+}
+inline uint64_t read_u64(std::istream& in) {
+  uint64_t lo = read_u32(in);
+  return lo | (uint64_t)read_u32(in) << 32;
+}
+inline Coord read_coord_u16(std::istream& in) {
+  int x = read_u16(in);
+  int y = read_u16(in);
+  return Coord{x,y};
+}
+inline std::string read_short_string(std::istream& in) {
+  std::string s(read_u8(in), '\0');
+  in.read(&s[0], s.size());
+  return s;
+}
+
+//------------------------------------------------------------------------------
+// Writer
+//------------------------------------------------------------------------------
+
+class RunLogWriter {
+private:
+  std::vector<char> buffer;
+  std::ofstream out;
+  Coord last_apple;
+  int keyframe_interval;
+  int turn = 0;
+  std::vector<uint64_t> keyframes; // file offset of the state after i*interval turns
+
+  void write_path(std::vector<Coord> const& path) {
+    write_u32(out, (uint32_t)path.size());
+    bool contiguous = !path.empty();
+    for (size_t i=1; i<path.size(); ++i) {
+      if (!is_neighbor(path[i], path[i-1])) contiguous = false;
+    }
+    write_u8(out, contiguous ? 1 : 0);
+    if (contiguous) {
+      write_coord_u16(out, path[0]);
+      int d = 0, n = 0;
+      for (size_t i=1; i<path.size(); ++i) {
+        d |= (int)(path[i] - path[i-1]) << (2*n);
+        if (++n == 4) {
+          write_u8(out, (uint8_t)d);
+          d = n = 0;
+        }
+      }
+      if (n > 0) write_u8(out, (uint8_t)d);
+    } else {
+      for (auto c : path) write_coord_u16(out, c);
+    }
+  }
+
+  void write_grid(Grid<bool> const& grid) {
+    int d = 0, n = 0;
+    for (auto c : grid.coords()) {
+      if (grid[c]) d |= 1 << n;
+      if (++n == 8) {
+        write_u8(out, (uint8_t)d);
+        d = n = 0;
+      }
+    }
+    if (n > 0) write_u8(out, (uint8_t)d);
+  }
+
+  void write_keyframe(GameBase const& game) {
+    keyframes.push_back((uint64_t)out.tellp());
+    write_u8(out, 'k');
+    write_u32(out, (uint32_t)turn);
+    write_coord_u16(out, game.apple_pos);
+    write_u32(out, (uint32_t)game.snake.size());
+    for (int i = 0; i < game.snake.size(); ++i) {
+      write_coord_u16(out, game.snake[i]);
+    }
+  }
+
+public:
+  RunLogWriter(std::string const& filename, std::string const& agent_name,
+               std::string const& agent_description, GameBase const& game,
+               int keyframe_interval = RUN_LOG_KEYFRAME_INTERVAL)
+    : buffer(1 << 20)
+    , keyframe_interval(keyframe_interval)
+  {
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out.open(filename, std::ios::binary);
+    out.write(RUN_LOG_MAGIC, sizeof(RUN_LOG_MAGIC));
+    write_u8(out, RUN_LOG_VERSION);
+    write_short_string(out, agent_name);
+    write_short_string(out, agent_description);
+    write_u16(out, (uint16_t)game.dimensions().w);
+    write_u16(out, (uint16_t)game.dimensions().h);
+    write_coord_u16(out, game.snake_pos());
+    write_coord_u16(out, game.apple_pos);
+    write_u32(out, (uint32_t)keyframe_interval);
+    last_apple = game.apple_pos;
+    // keyframe 0 is implicit in the header; its index entry points at the
+    // first record
+    keyframes.push_back((uint64_t)out.tellp());
+  }
+
+  // Record one turn; call after Game::move with the game state after the move
+  void move(Dir dir, Game::Event event, GameBase const& game) {
+    write_u8(out, 'm');
+    write_u8(out, (uint8_t)((int)dir | (int)event << 2));
+    if (event == Game::Event::eat) {
+      write_u8(out, 'a');
+      write_coord_u16(out, game.apple_pos);
+      last_apple = game.apple_pos;
+    }
+    turn++;
+    if (turn % keyframe_interval == 0 && event != Game::Event::lose) {
+      write_keyframe(game);
+    }
+  }
+
+  void agent_path(AgentLog::Key key, int turn, std::vector<Coord> const& path) {
+    write_u8(out, 'p');
+    write_u8(out, (uint8_t)key);
+    write_u32(out, (uint32_t)turn);
+    write_path(path);
+  }
+  void agent_grid(AgentLog::Key key, int turn, Grid<bool> const& grid) {
+    write_u8(out, 'g');
+    write_u8(out, (uint8_t)key);
+    write_u32(out, (uint32_t)turn);
+    write_grid(grid);
+  }
+  void agent_copy(AgentLog::Key key, int turn) {
+    write_u8(out, 'c');
+    write_u8(out, (uint8_t)key);
+    write_u32(out, (uint32_t)turn);
+  }
+
+  void finish(int turns, bool win) {
+    write_u8(out, 'e');
+    write_u32(out, (uint32_t)turns);
+    write_u8(out, win ? 1 : 0);
+    // footer: the keyframe index, so ReplayReader can seek without a scan
+    uint64_t footer = (uint64_t)out.tellp();
+    write_u32(out, (uint32_t)keyframes.size());
+    for (uint64_t off : keyframes) write_u64(out, off);
+    write_u32(out, (uint32_t)turns);
+    write_u8(out, win ? 1 : 0);
+    write_u64(out, footer);
+    out.write(RUN_LOG_INDEX_MAGIC, sizeof(RUN_LOG_INDEX_MAGIC));
+    out.close();
+  }
+};
+
+// An AgentLog that streams entries to a RunLogWriter instead of keeping them
+// in memory.
+struct StreamingAgentLog : AgentLog {
+  RunLogWriter& writer;
+
+  StreamingAgentLog(RunLogWriter& writer) : writer(writer) {}
+
+  void add(int turn, Key key, LogEntry value) override {
+    if (auto path = std::get_if<std::vector<Coord>>(&value)) {
+      writer.agent_path(key, turn, *path);
+    } else if (auto grid = std::get_if<Grid<bool>>(&value)) {
+      writer.agent_grid(key, turn, *grid);
+    } else if (std::get_if<CopyEntry>(&value)) {
+      writer.agent_copy(key, turn);
+    }
+  }
+};
+
+//------------------------------------------------------------------------------
+// Reader
+//------------------------------------------------------------------------------
+
+class RunLogReader {
+private:
+  std::ifstream in;
+
+public:
+  std::string agent_name, agent_description;
+  CoordRange dims;
+  Coord start, apple;
+  int keyframe_interval = 0; // 0 in version 1 logs, which have no keyframes
+
+  RunLogReader(std::string const& filename)
+    : in(filename, std::ios::binary)
+  {
+    if (!in) throw std::invalid_argument("Can't open run log: " + filename);
+    char magic[4];
+    in.read(magic, sizeof(magic));
+    uint8_t version = read_u8(in);
+    if (!std::equal(magic, magic+4, RUN_LOG_MAGIC) || version < 1 || version > RUN_LOG_VERSION) {
+      throw std::invalid_argument("Not a run log: " + filename);
+    }
+    agent_name = read_short_string(in);
+    agent_description = read_short_string(in);
+    dims.w = read_u16(in);
+    dims.h = read_u16(in);
+    start = read_coord_u16(in);
+    apple = read_coord_u16(in);
+    if (version >= 2) keyframe_interval = (int)read_u32(in);
+  }
+
+  // Next record tag, or 0 at the end of the file
+  int next_tag() {
+    int tag = in.get();
+    return tag == std::char_traits<char>::eof() ? 0 : tag;
+  }
+
+  void read_move(Dir& dir, Game::Event& event) {
+    uint8_t d = read_u8(in);
+    dir = (Dir)(d & 3);
+    event = (Game::Event)(d >> 2);
+  }
+  Coord read_apple() {
+    return read_coord_u16(in);
+  }
+  // sequential readers reconstruct the state from the moves, so keyframes are
+  // just skipped
+  void skip_keyframe() {
+    read_u32(in); // turn
+    read_coord_u16(in);
+    uint32_t n = read_u32(in);
+    in.ignore(4 * (std::streamsize)n);
+  }
+  void read_agent_key_turn(AgentLog::Key& key, int& turn) {
+    key = (AgentLog::Key)read_u8(in);
+    turn = (int)read_u32(in);
+  }
+  std::vector<Coord> read_path() {
+    std::vector<Coord> path(read_u32(in));
+    if (read_u8(in) == 1) {
+      if (!path.empty()) path[0] = read_coord_u16(in);
+      int d = 0, n = 0;
+      for (size_t i=1; i<path.size(); ++i) {
+        if (n == 0) {
+          d = read_u8(in);
+          n = 4;
+        }
+        path[i] = path[i-1] + (Dir)(d & 3);
+        d >>= 2;
+        n--;
+      }
+    } else {
+      for (auto& c : path) c = read_coord_u16(in);
+    }
+    return path;
+  }
+  Grid<bool> read_grid() {
+    Grid<bool> grid(dims);
+    int d = 0, n = 0;
+    for (auto c : grid.coords()) {
+      if (n == 0) {
+        d = read_u8(in);
+        n = 8;
+      }
+      grid[c] = (d & 1) != 0;
+      d >>= 1;
+      n--;
+    }
+    return grid;
+  }
+  void read_finish(int& turns, bool& win) {
+    turns = (int)read_u32(in);
+    win = read_u8(in) != 0;
+  }
+};
+
+//------------------------------------------------------------------------------
+// Seekable replay reader
+//------------------------------------------------------------------------------
+
+// Random access into a version 2 run log. The file is memory-mapped read-only
+// (zero-copy: the kernel pages in only what a seek touches) and the keyframe
+// index from the footer makes state_at(turn) cost O(keyframe interval + snake
+// length): decode the nearest earlier keyframe, then replay at most
+// keyframe_interval move records on top of it.
+class ReplayReader {
+private:
+  int fd = -1;
+  uint8_t const* map = nullptr;
+  size_t map_size = 0;
+  size_t index = 0;         // offset of the keyframe offset table
+  uint32_t num_keyframes = 0;
+
+  // the offsets in the records are not aligned, so go through memcpy
+  uint8_t u8_at(size_t off) const { return map[off]; }
+  uint16_t u16_at(size_t off) const {
+    uint16_t x;
+    std::memcpy(&x, map + off, sizeof(x));
+    return x;
+  }
+  uint32_t u32_at(size_t off) const {
+    uint32_t x;
+    std::memcpy(&x, map + off, sizeof(x));
+    return x;
+  }
+  uint64_t u64_at(size_t off) const {
+    uint64_t x;
+    std::memcpy(&x, map + off, sizeof(x));
+    return x;
+  }
+  Coord coord_at(size_t off) const {
+    return Coord{u16_at(off), u16_at(off + 2)};
+  }
+  std::string string_at(size_t& off) const {
+    std::string s((char const*)map + off + 1, u8_at(off));
+    off += 1 + s.size();
+    return s;
+  }
+
+  // the destructor doesn't run when the constructor throws
+  [[noreturn]] void fail(std::string const& message) {
+    munmap((void*)map, map_size);
+    ::close(fd);
+    throw std::invalid_argument(message);
+  }
+
+public:
+  std::string agent_name, agent_description;
+  CoordRange dims = {0,0};
+  Coord start = INVALID, first_apple = INVALID;
+  int keyframe_interval = 0;
+  int num_turns = 0;
+  bool win = false;
+
+  ReplayReader(std::string const& filename) {
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::invalid_argument("Can't open run log: " + filename);
+    struct stat st;
+    fstat(fd, &st);
+    map_size = (size_t)st.st_size;
+    map = (uint8_t const*)mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      ::close(fd);
+      throw std::invalid_argument("Can't map run log: " + filename);
+    }
+    // header
+    if (map_size < 13 || !std::equal(map, map+4, RUN_LOG_MAGIC) || u8_at(4) != RUN_LOG_VERSION) {
+      fail("Not a seekable run log: " + filename);
+    }
+    size_t off = 5;
+    agent_name = string_at(off);
+    agent_description = string_at(off);
+    dims.w = u16_at(off);
+    dims.h = u16_at(off + 2);
+    start = coord_at(off + 4);
+    first_apple = coord_at(off + 8);
+    keyframe_interval = (int)u32_at(off + 12);
+    // footer
+    if (!std::equal(map + map_size - 4, map + map_size, RUN_LOG_INDEX_MAGIC)) {
+      fail("Run log has no keyframe index (truncated?): " + filename);
+    }
+    size_t footer = (size_t)u64_at(map_size - 12);
+    num_keyframes = u32_at(footer);
+    index = footer + 4;
+    num_turns = (int)u32_at(index + 8 * num_keyframes);
+    win = u8_at(index + 8 * num_keyframes + 4) != 0;
+  }
+
+  ~ReplayReader() {
+    if (map != nullptr && map != MAP_FAILED) munmap((void*)map, map_size);
+    if (fd >= 0) ::close(fd);
+  }
+  ReplayReader(ReplayReader const&) = delete;
+
+  // Reconstruct the state after the given turn into `state`, which must have
+  // the replay's dimensions. Returns the turn actually reached (less than
+  // asked only past the end of the game).
+  int state_at(int turn, GameBase& state) const {
+    turn = std::max(0, std::min(turn, num_turns));
+    uint32_t kf = std::min((uint32_t)(turn / keyframe_interval), num_keyframes - 1);
+    size_t off = (size_t)u64_at(index + 8 * kf);
+    int cur = (int)kf * keyframe_interval;
+    // keyframe 0 is the header's start position
+    state.grid.clear();
+    state.snake.clear();
+    state.snake.push_front(start);
+    state.grid[start] = true;
+    state.apple_pos = first_apple;
+    while (off < map_size) {
+      switch (u8_at(off++)) {
+        case 'm': {
+          if (cur == turn) return cur;
+          uint8_t d = u8_at(off++);
+          auto event = (Game::Event)(d >> 2);
+          if (event == Game::Event::lose) return cur + 1; // the losing move doesn't move the head
+          Coord pos = state.snake_pos() + (Dir)(d & 3);
+          state.snake.push_front(pos);
+          state.grid[pos] = true;
+          if (event != Game::Event::eat) {
+            state.grid[state.snake.back()] = false;
+            state.snake.pop_back();
+          }
+          cur++;
+          break;
+        }
+        case 'a': {
+          state.apple_pos = coord_at(off);
+          off += 4;
+          break;
+        }
+        case 'k': {
+          // jump to the recorded state (when seeking this is the first record)
+          cur = (int)u32_at(off);
+          state.apple_pos = coord_at(off + 4);
+          uint32_t n = u32_at(off + 8);
+          off += 12;
+          state.grid.clear();
+          state.snake.clear();
+          for (uint32_t i = 0; i < n; ++i, off += 4) {
+            Coord c = coord_at(off);
+            state.snake.push_back(c);
+            state.grid[c] = true;
+          }
+          break;
+        }
+        case 'p': {
+          off += 5; // key, turn
+          uint32_t n = u32_at(off);
+          uint8_t mode = u8_at(off + 4);
+          off += 5 + (mode == 1 ? (n > 0 ? 4 + (n - 1 + 3) / 4 : 0) : 4 * n);
+          break;
+        }
+        case 'g': {
+          off += 5 + (dims.size() + 7) / 8;
+          break;
+        }
+        case 'c': {
+          off += 5;
+          break;
+        }
+        case 'e':
+        default:
+          return cur;
+      }
+    }
+    return cur;
+  }
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "util.hpp"
+#include "perf_counters.hpp"
 #include <climits>
 #include <queue>
 #include <vector>
@@ -12,15 +13,118 @@
 // Find shortest paths using breath first search
 struct Step {
   int dist;
-  Coord from;
+  Coord16 from; // packed, so a Step is 8 bytes instead of 12
   bool reachable() const {
     return dist < INT_MAX;
   }
 };
 
-template <typename CanMove>
-Grid<Step> generic_shortest_path(CoordRange dims, CanMove const& can_move, Coord from, Coord to = {-1,-1}) {
-  Grid<Step> out(dims, Step{INT_MAX, NOT_VISITED});
+//------------------------------------------------------------------------------
+// Bucket priority queue (Dial's algorithm)
+//------------------------------------------------------------------------------
+
+// Monotone priority queue for Dijkstra/A* with bounded integer edge costs.
+// Requirements (which hold for A* with a consistent heuristic):
+//  * a pushed key is never smaller than the last popped key
+//  * keys in the queue never span more than the `span` passed to reset()
+// Buckets are addressed circularly by key, and popping scans a bitmap of
+// nonempty buckets 64 at a time. Bucket storage is retained across reset()
+// calls, so a queue owned by a SearchContext allocates only on the first use.
+class BucketQueue {
+private:
+  std::vector<std::vector<Coord>> buckets;
+  std::vector<uint64_t> nonempty;
+  int num_buckets = 0; // power of two
+  int cursor_key = 0;  // lower bound on the minimum key in the queue
+  int count = 0;
+
+  inline int bucket(int key) const {
+    return key & (num_buckets - 1);
+  }
+
+public:
+  // Prepare for a search whose first pushed key is first_key
+  void reset(int span, int first_key) {
+    int want = 64;
+    while (want < span) want *= 2;
+    if (want > num_buckets) {
+      num_buckets = want;
+      buckets.resize(num_buckets);
+      nonempty.assign(num_buckets / 64, 0);
+    } else {
+      // only clear the buckets that were left nonempty by the previous search
+      for (int wi = 0; wi < (int)nonempty.size(); ++wi) {
+        uint64_t w = nonempty[wi];
+        while (w) {
+          buckets[wi*64 + __builtin_ctzll(w)].clear();
+          w &= w - 1;
+        }
+        nonempty[wi] = 0;
+      }
+    }
+    cursor_key = first_key;
+    count = 0;
+  }
+
+  bool empty() const {
+    return count == 0;
+  }
+
+  void push(int key, Coord c) {
+    // an inconsistent heuristic (e.g. negative penalties) can produce a key
+    // below the cursor; processing it right away is the closest we can get
+    if (key < cursor_key) key = cursor_key;
+    int i = bucket(key);
+    buckets[i].push_back(c);
+    nonempty[i/64] |= (uint64_t)1 << (i%64);
+    count++;
+  }
+
+  Coord pop() {
+    int start = bucket(cursor_key);
+    int words = num_buckets / 64;
+    int wi = start / 64;
+    uint64_t w = nonempty[wi] & (~(uint64_t)0 << (start % 64));
+    while (w == 0) {
+      wi = (wi + 1) & (words - 1);
+      w = nonempty[wi];
+    }
+    int i = wi*64 + __builtin_ctzll(w);
+    cursor_key += (i - start) & (num_buckets - 1);
+    Coord c = buckets[i].back();
+    buckets[i].pop_back();
+    if (buckets[i].empty()) {
+      nonempty[wi] &= ~((uint64_t)1 << (i%64));
+    }
+    count--;
+    return c;
+  }
+};
+
+// Reusable scratch space for the per-move searches.
+// An agent that owns one of these across moves lets generic_shortest_path,
+// astar_shortest_path and flood_fill start in O(1), instead of allocating and
+// clearing a fresh grid on every call.
+struct FillSegment;
+
+struct SearchContext {
+  StampedGrid<Step> steps;
+  // for the visited cells a packed BitGrid is used instead of a stamped grid:
+  // clearing it is a word-parallel fill, which is about as cheap as stamping
+  BitGrid visited;
+  // segment stack for the scanline flood fill, see flood_fill_go
+  std::vector<FillSegment> fill_stack;
+  // bucket queue for astar_shortest_path calls with bounded edge costs
+  BucketQueue astar_queue;
+
+  SearchContext(CoordRange dims)
+    : steps(dims, Step{INT_MAX, NOT_VISITED})
+    , visited(dims, false)
+  {}
+};
+
+template <typename StepGrid, typename CanMove>
+void generic_shortest_path_into(StepGrid& out, CoordRange dims, CanMove const& can_move, Coord from, Coord to = {-1,-1}) {
   std::vector<Coord> queue, next;
   queue.push_back(from);
   out[from].dist = 0;
@@ -29,27 +133,42 @@ Grid<Step> generic_shortest_path(CoordRange dims, CanMove const& can_move, Coord
   while (!queue.empty()) {
     dist++;
     for (auto a : queue) {
+      PERF_COUNT(astar_expanded);
       for (auto d : dirs) {
         Coord b = a + d;
         if (dims.valid(b) && can_move(a,b,d) && out[b].dist > dist) {
           out[b].dist = dist;
           out[b].from = a;
           next.push_back(b);
-          if (b == to) return out;
+          if (b == to) return;
         }
       }
     }
     std::swap(queue,next);
     next.clear();
   }
+}
+
+template <typename CanMove>
+Grid<Step> generic_shortest_path(CoordRange dims, CanMove const& can_move, Coord from, Coord to = {-1,-1}) {
+  Grid<Step> out(dims, Step{INT_MAX, NOT_VISITED});
+  generic_shortest_path_into(out, dims, can_move, from, to);
   return out;
 }
 
-Grid<Step> shortest_path(Grid<bool> const& grid, Coord from, Coord to = {-1,-1}) {
+template <typename CanMove>
+StampedGrid<Step>& generic_shortest_path(SearchContext& ctx, CoordRange dims, CanMove const& can_move, Coord from, Coord to = {-1,-1}) {
+  ctx.steps.clear();
+  generic_shortest_path_into(ctx.steps, dims, can_move, from, to);
+  return ctx.steps;
+}
+
+Grid<Step> shortest_path(BitGrid const& grid, Coord from, Coord to = {-1,-1}) {
   return generic_shortest_path(grid.coords(), [&grid](Coord a, Coord b, Dir d){ return !grid[b]; }, from, to);
 }
 
-Coord first_step(Grid<Step> const& path, Coord from, Coord to) {
+template <typename StepGrid>
+Coord first_step(StepGrid const& path, Coord from, Coord to) {
   while (to != ROOT && path[to].from != from) {
     if (to == NOT_VISITED) break;
     to = path[to].from;
@@ -59,7 +178,8 @@ Coord first_step(Grid<Step> const& path, Coord from, Coord to) {
 
 // Find all coords in a path from from to to, excluding the start point
 // Note: returned in reverse order, that is result.back() is the first step, result.front() == to
-std::vector<Coord> read_path(Grid<Step> const& paths, Coord from, Coord to) {
+template <typename StepGrid>
+std::vector<Coord> read_path(StepGrid const& paths, Coord from, Coord to) {
   std::vector<Coord> steps;
   while (to != ROOT && to != from) {
     steps.push_back(to);
@@ -83,9 +203,8 @@ std::ostream& operator << (std::ostream& out, Grid<Step> const& paths) {
 // Shortest paths with A-star algorithm
 //------------------------------------------------------------------------------
 
-template <typename Edge>
-Grid<Step> astar_shortest_path(CoordRange dims, Edge const& edges, Coord from, Coord to, int min_distance_cost=1) {
-  Grid<Step> out(dims, Step{INT_MAX, INVALID});
+template <typename StepGrid, typename Edge>
+void astar_shortest_path_into(StepGrid& out, CoordRange dims, Edge const& edges, Coord from, Coord to, int min_distance_cost=1) {
   struct Item {
     Coord c;
     int dist;
@@ -100,6 +219,7 @@ Grid<Step> astar_shortest_path(CoordRange dims, Edge const& edges, Coord from, C
   while (!queue.empty()) {
     auto item = queue.top();
     queue.pop();
+    PERF_COUNT(astar_expanded);
     if (item.c == to) break;
     for (auto d : dirs) {
       Coord b = item.c + d;
@@ -114,51 +234,504 @@ Grid<Step> astar_shortest_path(CoordRange dims, Edge const& edges, Coord from, C
       }
     }
   }
+}
+
+// A* with a BucketQueue instead of a binary heap. Only valid when every
+// passable edge costs at most max_edge_cost: popping is then O(1) amortized
+// instead of O(log n). Ties are broken in a different order than by the heap,
+// so the returned path can differ (but has the same cost).
+template <typename StepGrid, typename Edge>
+void astar_shortest_path_bucket_into(StepGrid& out, CoordRange dims, Edge const& edges, Coord from, Coord to, int min_distance_cost, int max_edge_cost, BucketQueue& queue) {
+  auto bound = [=](Coord a) { return min_distance_cost * (abs(a.x-to.x) + abs(a.y-to.y));};
+  // keys in the queue span at most one edge plus one heuristic step
+  queue.reset(max_edge_cost + min_distance_cost + 1, bound(from));
+  out[from].dist = 0;
+  queue.push(0+bound(from), from);
+  while (!queue.empty()) {
+    Coord c = queue.pop();
+    PERF_COUNT(astar_expanded);
+    if (c == to) break;
+    for (auto d : dirs) {
+      Coord b = c + d;
+      if (!dims.valid(b)) continue;
+      auto edge = edges(c,b,d);
+      if (edge == INT_MAX) continue;
+      int new_dist = out[c].dist + edge;
+      if (new_dist < out[b].dist) {
+        out[b].dist = new_dist;
+        out[b].from = c;
+        queue.push(new_dist+bound(b), b);
+      }
+    }
+  }
+}
+
+template <typename Edge>
+Grid<Step> astar_shortest_path(CoordRange dims, Edge const& edges, Coord from, Coord to, int min_distance_cost=1) {
+  Grid<Step> out(dims, Step{INT_MAX, INVALID});
+  astar_shortest_path_into(out, dims, edges, from, to, min_distance_cost);
   return out;
 }
 
+// When max_edge_cost > 0 the search uses the bucket queue in ctx; pass 0 for
+// unbounded edge costs to keep the binary heap.
+template <typename Edge>
+StampedGrid<Step>& astar_shortest_path(SearchContext& ctx, CoordRange dims, Edge const& edges, Coord from, Coord to, int min_distance_cost=1, int max_edge_cost=0) {
+  ctx.steps.clear();
+  if (max_edge_cost > 0) {
+    astar_shortest_path_bucket_into(ctx.steps, dims, edges, from, to, min_distance_cost, max_edge_cost, ctx.astar_queue);
+  } else {
+    astar_shortest_path_into(ctx.steps, dims, edges, from, to, min_distance_cost);
+  }
+  return ctx.steps;
+}
+
 //------------------------------------------------------------------------------
-// Flood fill
+// Incremental shortest paths (D* Lite)
 //------------------------------------------------------------------------------
 
-#include <assert.h>
+// Incremental variant of A*, based on D* Lite [Koenig & Likhachev, 2002].
+// For a fixed goal this maintains the distance from every coord to that goal.
+// When edge costs change (e.g. the snake moved) only the affected part of the
+// search is repaired, instead of searching from scratch.
+// The search runs backwards from the goal, so moving the start only shifts the
+// heuristic (the km offset), it doesn't invalidate anything.
+//
+// The edge functor is passed to every call instead of being stored, because
+// callers capture per-turn state in it. It must be consistent with the
+// update_edges_near() notifications: if an edge cost changed since the last
+// replan() without a notification, the repaired distances can be wrong.
+class IncrementalAstar {
+private:
+  Grid<int> g, rhs;
+  Coord start_, goal_;
+  int64_t km;
+  int min_edge_cost;
 
-template <typename CanMove>
-void flood_fill_go(Grid<bool>& out, CanMove const& can_move, Coord a) {
-  if (!out.valid(a)) {
-    std::cout << "ABOUT TO BREAK THINGS " << a << std::endl;
+  struct Key {
+    int64_t k1, k2;
+    inline bool operator < (Key const& that) const {
+      return k1 < that.k1 || (k1 == that.k1 && k2 < that.k2);
+    }
+  };
+  struct Item {
+    Key key;
+    Coord c;
+    inline bool operator < (Item const& that) const {
+      return that.key < key; // min-heap
+    }
+  };
+  std::priority_queue<Item> queue;
+
+  Key key(Coord c) const {
+    int m = std::min(g[c], rhs[c]);
+    if (m == INT_MAX) return Key{INT64_MAX, INT64_MAX};
+    return Key{m + (int64_t)min_edge_cost * manhattan_distance(c, start_) + km, m};
   }
-  int y = a.y;
-  // find left/rightmost points
-  int min_x = a.x;
-  while (min_x > 0) {
-    if (can_move(Coord{min_x,y},Coord{min_x-1,y},Dir::left) && !out[Coord{min_x-1,y}]) {
-      min_x--;
-    } else {
-      break;
+
+  // Recompute rhs from the successors of u, and queue u if it became inconsistent
+  template <typename Edge>
+  void update_vertex(Edge const& edges, Coord u) {
+    if (u != goal_) {
+      int best = INT_MAX;
+      for (auto d : dirs) {
+        Coord b = u + d;
+        if (!g.valid(b) || g[b] == INT_MAX) continue;
+        auto edge = edges(u, b, d);
+        if (edge != INT_MAX) best = std::min(best, edge + g[b]);
+      }
+      rhs[u] = best;
     }
+    if (g[u] != rhs[u]) queue.push(Item{key(u), u});
   }
-  int max_x = a.x;
-  while (max_x + 1 < out.w) {
-    if (can_move(Coord{max_x,y},Coord{max_x+1,y},Dir::right) && !out[Coord{max_x+1,y}]) {
-      max_x++;
-    } else {
-      break;
+
+public:
+  IncrementalAstar(CoordRange dims, int min_edge_cost = 1)
+    : g(dims, INT_MAX)
+    , rhs(dims, INT_MAX)
+    , start_(INVALID), goal_(INVALID)
+    , km(0)
+    , min_edge_cost(min_edge_cost)
+  {}
+
+  Coord goal() const { return goal_; }
+
+  // Invalidate the search; the next new_goal() starts from scratch
+  void reset() {
+    start_ = goal_ = INVALID;
+  }
+
+  // Forget everything and start a fresh search towards a new goal
+  void new_goal(Coord start, Coord goal) {
+    std::fill(g.begin(), g.end(), INT_MAX);
+    std::fill(rhs.begin(), rhs.end(), INT_MAX);
+    queue = {};
+    km = 0;
+    start_ = start;
+    goal_ = goal;
+    rhs[goal] = 0;
+    queue.push(Item{key(goal), goal});
+  }
+
+  // The start moved, only the heuristic offset changes
+  void move_start(Coord start) {
+    km += (int64_t)min_edge_cost * manhattan_distance(start_, start);
+    start_ = start;
+  }
+
+  // Edge costs in the neighborhood of c changed, repair the affected vertices.
+  // An edge (u,v) can depend on the state of c when u or v is (a neighbor of) c,
+  // so everything within distance 2 needs its rhs recomputed.
+  template <typename Edge>
+  void update_edges_near(Edge const& edges, Coord c) {
+    for (int dy = -2; dy <= 2; ++dy) {
+      for (int dx = -2 + std::abs(dy); dx <= 2 - std::abs(dy); ++dx) {
+        Coord u = {c.x + dx, c.y + dy};
+        if (g.valid(u)) update_vertex(edges, u);
+      }
+    }
+  }
+
+  // Repair distances until the start is consistent (or known unreachable)
+  template <typename Edge>
+  void replan(Edge const& edges) {
+    while (!queue.empty()) {
+      if (!(queue.top().key < key(start_)) && rhs[start_] == g[start_]) break;
+      Key k_old = queue.top().key;
+      Coord u = queue.top().c;
+      queue.pop();
+      PERF_COUNT(astar_expanded);
+      if (g[u] == rhs[u]) continue; // stale entry, u is already consistent
+      Key k_new = key(u);
+      if (k_old < k_new) {
+        queue.push(Item{k_new, u});
+      } else if (g[u] > rhs[u]) {
+        g[u] = rhs[u];
+        for (auto d : dirs) {
+          Coord p = u + d;
+          if (g.valid(p)) update_vertex(edges, p);
+        }
+      } else {
+        g[u] = INT_MAX;
+        update_vertex(edges, u);
+        for (auto d : dirs) {
+          Coord p = u + d;
+          if (g.valid(p)) update_vertex(edges, p);
+        }
+      }
+    }
+  }
+
+  // Is the goal reachable from the start? (only valid after replan())
+  bool reachable() const {
+    return rhs[start_] != INT_MAX;
+  }
+
+  // Distance from c to the goal, INT_MAX if unreachable
+  int distance(Coord c) const {
+    return g[c];
+  }
+
+  // Best next step from u towards the goal, INVALID if there is none
+  template <typename Edge>
+  Coord next_step(Edge const& edges, Coord u) const {
+    Coord best = INVALID;
+    int best_dist = INT_MAX;
+    for (auto d : dirs) {
+      Coord b = u + d;
+      if (!g.valid(b) || g[b] == INT_MAX) continue;
+      auto edge = edges(u, b, d);
+      if (edge != INT_MAX && edge + g[b] < best_dist) {
+        best = b;
+        best_dist = edge + g[b];
+      }
+    }
+    return best;
+  }
+
+  // Path from the start to the goal, in the same (reversed) order as read_path:
+  // result.back() is the first step, result.front() == goal
+  template <typename Edge>
+  std::vector<Coord> read_path(Edge const& edges) const {
+    std::vector<Coord> steps;
+    Coord c = start_;
+    for (int i = 0; i < g.size(); ++i) {
+      c = next_step(edges, c);
+      if (c == INVALID) break;
+      steps.push_back(c);
+      if (c == goal_) break;
+    }
+    std::reverse(steps.begin(), steps.end());
+    return steps;
+  }
+};
+
+//------------------------------------------------------------------------------
+// Hierarchical shortest paths (HPA*-style)
+//------------------------------------------------------------------------------
+
+// Per-move A* expands O(w*h) cells, which makes very large boards
+// impractical. HierarchicalPathfinder clusters the board into BxB blocks and
+// maintains, per block, the connected components of its free cells. An
+// abstract search over (block, component) nodes finds the corridor of blocks
+// an optimal-ish path passes through; the real weighted search is then
+// restricted to that corridor (see hierarchical_shortest_path), so the
+// per-move cost is proportional to the corridor instead of the board area.
+// Block data is invalidated incrementally: sync() word-diffs the grid against
+// the last seen state and recomputes only the components of blocks where a
+// cell was occupied or freed since the previous move.
+class HierarchicalPathfinder {
+public:
+  // Cells the refinement search may use, valid after find_corridor
+  BitGrid corridor;
+
+  HierarchicalPathfinder(CoordRange dims, int block_size = 8)
+    : corridor(dims, false)
+    , dims(dims), block(block_size)
+    , bw((dims.w+block_size-1)/block_size)
+    , bh((dims.h+block_size-1)/block_size)
+    , known(dims, false)
+    , comp(dims, NO_COMP)
+    , dirty(bw*bh, true)
+    , node_dist(bw*bh*max_comps(), INT_MAX)
+    , node_from(bw*bh*max_comps(), -1)
+  {}
+
+  // Absorb the cells that changed since the last call, marking their blocks
+  // for recomputation. Word-parallel, so a quiet board costs O(w*h/64).
+  void sync(BitGrid const& grid) {
+    known.for_each_diff(grid, [&](Coord c) {
+      known[c] = grid[c];
+      dirty[block_of(c)] = true;
+    });
+  }
+
+  // Find the corridor of blocks a shortest path from..to passes through,
+  // minimizing the number of block crossings. The start cell may be occupied
+  // (the snake's head is), in which case its free neighbors seed the search.
+  // Returns false when the abstract graph has no path; the caller should then
+  // fall back to a full-board search.
+  bool find_corridor(BitGrid const& grid, Coord from, Coord to) {
+    sync(grid);
+    for (int b = 0; b < bw*bh; ++b) {
+      if (dirty[b]) {
+        rebuild_block(b);
+        dirty[b] = false;
+      }
+    }
+    if (comp[to] == NO_COMP) return false;
+    // BFS over (block, component) nodes
+    for (int id : touched) {
+      node_dist[id] = INT_MAX;
+      node_from[id] = -1;
+    }
+    touched.clear();
+    queue.clear();
+    if (comp[from] != NO_COMP) seed(node_id(from));
+    for (auto d : dirs) {
+      Coord q = from + d;
+      if (known.is_clear(q)) seed(node_id(q));
+    }
+    const int goal = node_id(to);
+    for (size_t i = 0; i < queue.size(); ++i) {
+      int id = queue[i];
+      if (id == goal) {
+        // mark the component cells of every block on the abstract path
+        corridor.clear();
+        for (; id != -1; id = node_from[id]) {
+          mark_block(id / max_comps(), (uint8_t)(id % max_comps()));
+        }
+        return true;
+      }
+      expand(id);
+    }
+    return false;
+  }
+
+private:
+  CoordRange dims;
+  int block;   // block size in cells
+  int bw, bh;  // number of blocks in each direction
+  BitGrid known;            // grid state the block data was computed from
+  Grid<uint8_t> comp;       // free component of each cell within its block
+  std::vector<bool> dirty;  // per block: components need recomputing
+  // abstract search state, reset lazily through the touched list
+  std::vector<int> node_dist;
+  std::vector<int> node_from;
+  std::vector<int> touched;
+  std::vector<int> queue;
+  std::vector<Coord> fill_stack;
+
+  static const uint8_t NO_COMP = 0xff;
+
+  // worst case (a checkerboard) has one component per two cells
+  inline int max_comps() const { return (block*block+1)/2; }
+  inline int block_of(Coord c) const { return (c.x/block) + bw*(c.y/block); }
+  inline int node_id(Coord c) const { return block_of(c)*max_comps() + comp[c]; }
+
+  void seed(int id) {
+    if (node_dist[id] != INT_MAX) return;
+    node_dist[id] = 0;
+    touched.push_back(id);
+    queue.push_back(id);
+  }
+
+  void relax(int id, int from_id) {
+    if (node_dist[id] != INT_MAX) return;
+    node_dist[id] = node_dist[from_id] + 1;
+    node_from[id] = from_id;
+    touched.push_back(id);
+    queue.push_back(id);
+  }
+
+  // relabel the free components of one block with a small flood fill
+  void rebuild_block(int b) {
+    int x0 = (b % bw) * block, y0 = (b / bw) * block;
+    int x1 = std::min(x0 + block, dims.w), y1 = std::min(y0 + block, dims.h);
+    for (int y = y0; y < y1; ++y) {
+      for (int x = x0; x < x1; ++x) {
+        comp[{x,y}] = NO_COMP;
+      }
+    }
+    uint8_t next_comp = 0;
+    for (int y = y0; y < y1; ++y) {
+      for (int x = x0; x < x1; ++x) {
+        if (known[{x,y}] || comp[{x,y}] != NO_COMP) continue;
+        fill_stack.clear();
+        fill_stack.push_back({x,y});
+        comp[{x,y}] = next_comp;
+        while (!fill_stack.empty()) {
+          Coord c = fill_stack.back();
+          fill_stack.pop_back();
+          for (auto d : dirs) {
+            Coord q = c + d;
+            if (q.x < x0 || q.x >= x1 || q.y < y0 || q.y >= y1) continue;
+            if (known[q] || comp[q] != NO_COMP) continue;
+            comp[q] = next_comp;
+            fill_stack.push_back(q);
+          }
+        }
+        next_comp++;
+      }
+    }
+  }
+
+  // visit the abstract neighbors: components of adjacent blocks reachable
+  // through a free border crossing. Cross edges are found by scanning the
+  // border on the fly, so changing a block never invalidates its neighbors.
+  void expand(int id) {
+    int b = id / max_comps();
+    uint8_t k = (uint8_t)(id % max_comps());
+    int x0 = (b % bw) * block, y0 = (b / bw) * block;
+    int x1 = std::min(x0 + block, dims.w), y1 = std::min(y0 + block, dims.h);
+    auto cross = [&](Coord p, Dir d) {
+      if (comp[p] != k) return;
+      Coord q = p + d;
+      if (known.is_clear(q)) relax(node_id(q), id);
+    };
+    for (int x = x0; x < x1; ++x) {
+      if (y0 > 0)      cross({x,y0},   Dir::up);
+      if (y1 < dims.h) cross({x,y1-1}, Dir::down);
+    }
+    for (int y = y0; y < y1; ++y) {
+      if (x0 > 0)      cross({x0,y},   Dir::left);
+      if (x1 < dims.w) cross({x1-1,y}, Dir::right);
     }
   }
-  // mark
-  std::fill(&out[Coord{min_x,y}], &out[Coord{max_x,y}]+1, true);
-  // up/down
-  for (int x=min_x; x<=max_x; ++x) {
-    if (y > 0 && can_move(Coord{x,y},Coord{x,y-1},Dir::up) && !out[Coord{x,y-1}]) {
-      flood_fill_go(out, can_move, Coord{x,y-1});
+
+  void mark_block(int b, uint8_t k) {
+    int x0 = (b % bw) * block, y0 = (b / bw) * block;
+    int x1 = std::min(x0 + block, dims.w), y1 = std::min(y0 + block, dims.h);
+    for (int y = y0; y < y1; ++y) {
+      for (int x = x0; x < x1; ++x) {
+        if (comp[{x,y}] == k) corridor[{x,y}] = true;
+      }
     }
-    if (y+1 < out.h && can_move(Coord{x,y},Coord{x,y+1},Dir::down) && !out[Coord{x,y+1}]) {
-      flood_fill_go(out, can_move, Coord{x,y+1});
+  }
+};
+
+// astar_shortest_path restricted to the corridor found by the abstract
+// search. Any free path inside the corridor reaches the goal, so the
+// refinement only fails when find_corridor does, in which case we fall back
+// to the plain full-board search.
+// Same Step grid + read_path interface as the other searches.
+template <typename Edge>
+StampedGrid<Step>& hierarchical_shortest_path(SearchContext& ctx, HierarchicalPathfinder& hier, BitGrid const& grid, Edge const& edges, Coord from, Coord to, int min_distance_cost=1, int max_edge_cost=0) {
+  if (hier.find_corridor(grid, from, to)) {
+    auto corridor_edges = [&](Coord a, Coord b, Dir dir) {
+      return hier.corridor[b] ? edges(a,b,dir) : INT_MAX;
+    };
+    auto& steps = astar_shortest_path(ctx, grid.coords(), corridor_edges, from, to, min_distance_cost, max_edge_cost);
+    if (steps[to].dist != INT_MAX) return steps;
+  }
+  return astar_shortest_path(ctx, grid.coords(), edges, from, to, min_distance_cost, max_edge_cost);
+}
+
+//------------------------------------------------------------------------------
+// Flood fill
+//------------------------------------------------------------------------------
+
+#include <assert.h>
+
+// One horizontal run of candidate cells for the scanline flood fill:
+// the cells (x,y) for x in [x0,x1], entered from row y-dy (dy 0 for the seed)
+struct FillSegment {
+  int x0, x1, y, dy;
+};
+
+// Iterative scanline flood fill. The segment stack is owned by the caller so
+// it can be reused across fills; unlike the old recursive version this cannot
+// overflow the call stack on large serpentine regions.
+template <typename BoolGrid, typename CanMove>
+void flood_fill_go(BoolGrid& out, CanMove const& can_move, Coord a, std::vector<FillSegment>& stack) {
+  if (!out.valid(a)) {
+    std::cout << "ABOUT TO BREAK THINGS " << a << std::endl;
+  }
+  stack.clear();
+  stack.push_back(FillSegment{a.x, a.x, a.y, 0});
+  while (!stack.empty()) {
+    FillSegment seg = stack.back();
+    stack.pop_back();
+    int y = seg.y;
+    for (int x = seg.x0; x <= seg.x1; ++x) {
+      if (out[Coord{x,y}]) continue;
+      if (seg.dy != 0 && !can_move(Coord{x,y-seg.dy}, Coord{x,y}, seg.dy > 0 ? Dir::down : Dir::up)) continue;
+      // find left/rightmost points
+      int min_x = x;
+      while (min_x > 0) {
+        if (can_move(Coord{min_x,y},Coord{min_x-1,y},Dir::left) && !out[Coord{min_x-1,y}]) {
+          min_x--;
+        } else {
+          break;
+        }
+      }
+      int max_x = x;
+      while (max_x + 1 < out.w) {
+        if (can_move(Coord{max_x,y},Coord{max_x+1,y},Dir::right) && !out[Coord{max_x+1,y}]) {
+          max_x++;
+        } else {
+          break;
+        }
+      }
+      // mark
+      for (int i=min_x; i<=max_x; ++i) {
+        out[Coord{i,y}] = true;
+      }
+      PERF_COUNT_N(flood_cells, max_x - min_x + 1);
+      // queue the rows above and below
+      if (y > 0)        stack.push_back(FillSegment{min_x, max_x, y-1, -1});
+      if (y+1 < out.h)  stack.push_back(FillSegment{min_x, max_x, y+1, +1});
+      x = max_x; // everything up to max_x is marked now
     }
   }
 }
 
+template <typename BoolGrid, typename CanMove>
+void flood_fill_go(BoolGrid& out, CanMove const& can_move, Coord a) {
+  std::vector<FillSegment> stack;
+  flood_fill_go(out, can_move, a, stack);
+}
+
 template <typename CanMove>
 Grid<bool> flood_fill(CoordRange dims, CanMove const& can_move, Coord from) {
   Grid<bool> out(dims, false);
@@ -166,8 +739,15 @@ Grid<bool> flood_fill(CoordRange dims, CanMove const& can_move, Coord from) {
   return out;
 }
 
+template <typename CanMove>
+BitGrid& flood_fill(SearchContext& ctx, CoordRange dims, CanMove const& can_move, Coord from) {
+  ctx.visited.clear();
+  flood_fill_go(ctx.visited, can_move, from, ctx.fill_stack);
+  return ctx.visited;
+}
+
 // flood fill starting at a neihbor of from
-Grid<bool> flood_fill_from_neighbor(Grid<bool> const& grid, Coord from) {
+Grid<bool> flood_fill_from_neighbor(BitGrid const& grid, Coord from) {
   Grid<bool> out(grid.dimensions(), false);
   for (Dir d : dirs) {
     if (grid.is_clear(from + d)) {
@@ -178,7 +758,7 @@ Grid<bool> flood_fill_from_neighbor(Grid<bool> const& grid, Coord from) {
   return out;
 }
 // flood fill from a single position
-Grid<bool> flood_fill(Grid<bool> const& grid) {
+Grid<bool> flood_fill(BitGrid const& grid) {
   Grid<bool> out(grid.dimensions(), false);
   for (Coord c : grid.coords()) {
     if (!grid[c]) {
@@ -4,8 +4,11 @@
 #include "zig_zag_agent.hpp"
 #include "cell_tree_agent.hpp"
 #include "hamiltonian_cycle.hpp"
+#include "perf_counters.hpp"
+#include "run_log.hpp"
 
 #include <unistd.h>
+#include <chrono>
 #include <cmath>
 #include <fstream>
 #include <iomanip>
@@ -13,6 +16,8 @@
 #include <functional>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <sstream>
 
 //------------------------------------------------------------------------------
 // Logging games
@@ -54,30 +59,127 @@ public:
 // Stats of multiple games
 //------------------------------------------------------------------------------
 
+// --exact: keep every round's turn count, so quantiles are computed exactly
+// instead of estimated from the streaming digest
+bool exact_stats = false;
+
 struct Stats {
-  std::vector<int> turns;
-  std::vector<bool> wins;
-  
+  // Streaming accumulators: adding a round is O(1) and the memory use is
+  // bounded, so summaries stay cheap at millions of rounds. Only the turn
+  // counts of won games are accumulated, losses only show up in the loss rate.
+  StreamingMeanVar turn_dist;
+  StreamingQuantiles turn_digest;
+  int64_t num_rounds = 0;
+  int64_t num_wins = 0;
+  std::vector<int> turns; // per-round turn counts, only kept with --exact
+  // hot path counters accumulated over the played rounds (see perf_counters.hpp);
+  // rounds loaded from a results file contribute nothing here
+  PerfCounters perf;
+
   void add(Game const& game);
+  void add(int num_turns, bool win);
+  void merge(Stats const& that);
+
+  double loss_rate() const {
+    return num_rounds ? 1 - (double)num_wins / num_rounds : 0;
+  }
+  double mean_turns() const {
+    return exact_stats && !turns.empty() ? mean(turns) : turn_dist.mean();
+  }
+  double stddev_turns() const {
+    return exact_stats && !turns.empty() ? stddev(turns) : turn_dist.stddev();
+  }
+  // [min, q.25, median, q.75, max] like quantiles(); min and max are exact
+  // either way, the quartiles are estimates without --exact
+  std::vector<double> turn_quantiles() const {
+    if (exact_stats && !turns.empty()) return quantiles(turns);
+    return {turn_digest.min(), turn_digest.quantile(0.25), turn_digest.quantile(0.5),
+            turn_digest.quantile(0.75), turn_digest.max()};
+  }
 };
 
 void Stats::add(Game const& game) {
-  wins.push_back(game.win());
-  if (game.win()) {
-    turns.push_back(game.turn);
+  add(game.turn, game.win());
+  // the game was played to completion on this thread, so the thread's
+  // counters hold exactly this game's counts
+  perf += perf_counters.take();
+}
+
+void Stats::add(int num_turns, bool win) {
+  num_rounds++;
+  if (win) {
+    num_wins++;
+    turn_dist.add(num_turns);
+    turn_digest.add(num_turns);
+    if (exact_stats) turns.push_back(num_turns);
   }
 }
 
+void Stats::merge(Stats const& that) {
+  turn_dist.merge(that.turn_dist);
+  turn_digest.merge(that.turn_digest);
+  num_rounds += that.num_rounds;
+  num_wins += that.num_wins;
+  turns.insert(turns.end(), that.turns.begin(), that.turns.end());
+  perf += that.perf;
+}
+
 std::ostream& operator << (std::ostream& out, Stats const& stats) {
-  out << "turns: mean " << mean(stats.turns);
-  out << ", stddev " << stddev(stats.turns);
-  out << ", quantiles " << quantiles(stats.turns);
-  if (mean(stats.wins) < 1) {
-    out << "  LOST: " << (1-mean(stats.wins))*100 << "%";
+  out << "turns: mean " << stats.mean_turns();
+  out << ", stddev " << stats.stddev_turns();
+  out << ", quantiles " << stats.turn_quantiles();
+  if (stats.loss_rate() > 0) {
+    out << "  LOST: " << stats.loss_rate()*100 << "%";
   }
   return out;
 }
 
+// Per-round averages of the hot path counters, printed after the summary of a
+// single-agent run (all zeros, and so omitted, with SNAKE_NO_PERF_COUNTERS)
+void write_perf_counters(std::ostream& out, Stats const& stats) {
+  if (!stats.perf.any()) return;
+  auto const& p = stats.perf;
+  double rounds = (double)std::max<int64_t>(1, stats.num_rounds);
+  out << "counters/round: astar " << (uint64_t)(p.astar_expanded/rounds);
+  out << ", flood " << (uint64_t)(p.flood_cells/rounds);
+  out << ", repair " << (uint64_t)(p.repair_attempts/rounds);
+  out << " (" << (uint64_t)(p.repair_successes/rounds) << " ok, "
+      << (uint64_t)(p.repair_cells/rounds) << " cells)";
+  out << ", cache " << (uint64_t)(p.cache_hits/rounds)
+      << "/" << (uint64_t)((p.cache_hits+p.cache_misses)/rounds);
+  out << ", detours " << (uint64_t)(p.detours/rounds);
+  out << std::endl;
+}
+
+// Summary table in csv format, used by the `all` and `merge` modes
+const char* STATS_CSV_HEADER = "agent, mean, stddev, min, q.25, median, q.75, max, lost, astar/r, flood/r, repair/r, fixed/r, cache%, detour/r";
+
+void write_stats_row(std::ostream& out, std::string const& name, Stats const& stats) {
+  using namespace std;
+  out << left << setw(15) << name << ", ";
+  out << right << fixed << setprecision(1);
+  out << setw(8) << stats.mean_turns() << ", ";
+  out << setw(8) << stats.stddev_turns() << ", ";
+  out << setprecision(0);
+  for (auto q : stats.turn_quantiles()) {
+    out << setw(8) << q << ", ";
+  }
+  out << setprecision(1);
+  out << setw(8) << (stats.loss_rate()*100) << "%, ";
+  auto const& p = stats.perf;
+  double rounds = (double)max<int64_t>(1, stats.num_rounds);
+  out << setprecision(0);
+  out << setw(9) << p.astar_expanded/rounds << ", ";
+  out << setw(9) << p.flood_cells/rounds << ", ";
+  out << setw(8) << p.repair_attempts/rounds << ", ";
+  out << setw(7) << p.repair_successes/rounds << ", ";
+  uint64_t cache_total = p.cache_hits + p.cache_misses;
+  out << setprecision(1);
+  out << setw(6) << (cache_total ? 100.0*p.cache_hits/cache_total : 0.0) << "%, ";
+  out << setprecision(0);
+  out << setw(8) << p.detours/rounds;
+}
+
 //------------------------------------------------------------------------------
 // Configuration
 //------------------------------------------------------------------------------
@@ -92,69 +194,136 @@ struct Config {
   bool quiet = false;
   int num_threads = static_cast<int>(std::thread::hardware_concurrency());
   std::string json_file;
+  std::string log_file;
+  std::string resume_file;
   bool json_compact = true;
+  // this process plays shard_index of num_shards (see --shard)
+  int shard_index = 0;
+  int num_shards = 1;
+  // rounds stepped in lockstep per thread, for cheap agents (see LockstepRunner)
+  int batch_size = 1;
   RNG rng = global_rng;
-  
+  // the zig-zag cycle and its order labels, built once per campaign and
+  // shared read-only by every round on every thread (see SharedCycle)
+  std::shared_ptr<SharedCycle const> zig_zag;
+
   void parse_optional_args(int argc, const char** argv);
+
+  std::shared_ptr<SharedCycle const> zig_zag_cycle() {
+    if (!zig_zag) zig_zag = std::make_shared<SharedCycle>(make_zig_zag_path(board_size));
+    return zig_zag;
+  }
+
+  inline bool in_shard(int round) const {
+    return round % num_shards == shard_index;
+  }
+  inline int num_shard_rounds() const {
+    return (num_rounds - shard_index + num_shards - 1) / num_shards;
+  }
 };
 
 //------------------------------------------------------------------------------
 // Agents
 //------------------------------------------------------------------------------
 
+template <typename Game, typename AgentT>
+void play(Game& game, AgentT& agent, Config const& config, AgentLog* log = nullptr);
+template <typename AgentGen>
+Stats play_multiple(AgentGen make_agent, Config& config, std::string const& agent_name = "", bool lockstep = false);
+
 struct AgentFactory {
   std::string name;
   std::string description;
   std::function<std::unique_ptr<Agent>(Config&)> make;
+  // These are instantiated on the concrete agent type by agent_factory(), so
+  // the per-move agent call in the play loop is statically dispatched instead
+  // of going through Agent's vtable (see play_loop).
+  std::function<Stats(Config&)> play_stats;
+  std::function<void(Game&, Agent&, Config const&)> play_game;
+  // cheap table-lookup agent: play_multiple steps a batch of rounds in
+  // lockstep instead of one game at a time (see LockstepRunner)
+  bool lockstep = false;
 };
+
+template <typename MakeAgent>
+AgentFactory agent_factory(std::string name, std::string description, MakeAgent make, bool lockstep = false) {
+  using ConcreteAgent = typename decltype(make(std::declval<Config&>()))::element_type;
+  return {
+    name, description,
+    make,
+    [name,make,lockstep](Config& config) {
+      return play_multiple(make, config, name, lockstep);
+    },
+    [](Game& game, Agent& agent, Config const& config) {
+      play(game, static_cast<ConcreteAgent&>(agent), config);
+    },
+    lockstep,
+  };
+}
+
 AgentFactory agents[] = {
-  {"zig-zag", "Follows a fixed zig-zag cycle", [](Config&) {
+  agent_factory("zig-zag", "Follows a fixed zig-zag cycle", [](Config&) {
     return std::make_unique<FixedZigZagAgent>();
-  }},
-  {"fixed", "Follows a fixed but random cycle", [](Config& config) {
-    return std::make_unique<FixedCycleAgent>(random_hamiltonian_cycle(config.board_size, config.rng));
-  }},
-  {"zig-zag-cut", "Follows a zig-zag cycle, but can take shortcuts", [](Config& config) {
+  }, true),
+  agent_factory("fixed", "Follows a fixed but random cycle", [](Config& config) {
+    auto agent = std::make_unique<FixedCycleAgent>(random_hamiltonian_cycle(config.board_size, config.rng));
+    agent->randomize = true; // each round gets its own cycle
+    return agent;
+  }, true),
+  agent_factory("zig-zag-cut", "Follows a zig-zag cycle, but can take shortcuts", [](Config& config) {
     return std::make_unique<CutAgent>();
-  }},
-  {"cell", "Limit movement to a tree of 2x2 cells", [](Config&) {
-    return std::make_unique<CellTreeAgent>();
-  }},
-  {"cell1", "Cell tree agent with limited lookahead", [](Config&) {
-    auto agent = std::make_unique<CellTreeAgent>();
+  }, true),
+  agent_factory("cell", "Limit movement to a tree of 2x2 cells", [](Config& config) {
+    return std::make_unique<CellTreeAgent>(config.board_size);
+  }),
+  agent_factory("cell1", "Cell tree agent with limited lookahead", [](Config& config) {
+    auto agent = std::make_unique<CellTreeAgent>(config.board_size);
     agent->lookahead = Lookahead::one;
     return agent;
-  }},
-  {"cell-keep", "Cell tree agent which doesn't move snake in lookahead", [](Config&) {
-    auto agent = std::make_unique<CellTreeAgent>();
+  }),
+  agent_factory("cell-keep", "Cell tree agent which doesn't move snake in lookahead", [](Config& config) {
+    auto agent = std::make_unique<CellTreeAgent>(config.board_size);
     agent->lookahead = Lookahead::many_keep_tail;
     return agent;
-  }},
-  {"cell-fixed", "Cell agent that doesn't recalculate paths", [](Config&) {
-    auto agent = std::make_unique<CellTreeAgent>();
+  }),
+  agent_factory("cell-fixed", "Cell agent that doesn't recalculate paths", [](Config& config) {
+    auto agent = std::make_unique<CellTreeAgent>(config.board_size);
     agent->recalculate_path = false;
     return agent;
-  }},
-  {"cell-variant", "Cell tree agent with penalties on moving in the tree", [](Config&) {
-    auto agent = std::make_unique<CellTreeAgent>();
+  }),
+  agent_factory("cell-incremental", "Cell tree agent with incremental (D* Lite) replanning", [](Config& config) {
+    return std::make_unique<IncrementalCellTreeAgent>(config.board_size);
+  }),
+  agent_factory("cell-speculative", "Cell tree agent that verifies reachability on a worker thread", [](Config& config) {
+    auto agent = std::make_unique<CellTreeAgent>(config.board_size);
+    agent->speculative = true;
+    return agent;
+  }),
+  agent_factory("cell-variant", "Cell tree agent with penalties on moving in the tree", [](Config& config) {
+    auto agent = std::make_unique<CellTreeAgent>(config.board_size);
     agent->same_cell_penalty = 500-1;
     agent->new_cell_penalty = 2400;
     agent->parent_cell_penalty = 0;
     return agent;
-  }},
-  {"phc", "Perturbed Hamiltonian cycle (zig-zag cycle)", [](Config& config) {
-    auto agent = std::make_unique<PerturbedHamiltonianCycle>(make_zig_zag_path(config.board_size));
+  }),
+  agent_factory("phc", "Perturbed Hamiltonian cycle (zig-zag cycle)", [](Config& config) {
+    auto agent = std::make_unique<PerturbedHamiltonianCycle>(config.zig_zag_cycle());
     return agent;
-  }},
-  {"dhcr", "Dynamic Hamiltonian Cycle Repair", [](Config& config) {
-    auto agent = std::make_unique<DynamicHamiltonianCycleRepair>(make_zig_zag_path(config.board_size));
+  }, true),
+  agent_factory("dhcr", "Dynamic Hamiltonian Cycle Repair", [](Config& config) {
+    auto agent = std::make_unique<DynamicHamiltonianCycleRepair>(config.zig_zag_cycle());
     return agent;
-  }},
-  {"dhcr-nascar", "Dynamic Hamiltonian Cycle Repair with Nascar mode", [](Config& config) {
-    auto agent = std::make_unique<DynamicHamiltonianCycleRepair>(make_zig_zag_path(config.board_size));
+  }),
+  agent_factory("dhcr-nascar", "Dynamic Hamiltonian Cycle Repair with Nascar mode", [](Config& config) {
+    auto agent = std::make_unique<DynamicHamiltonianCycleRepair>(config.zig_zag_cycle());
     agent->wall_follow_overshoot = 1;
     return agent;
-  }},
+  }),
+  agent_factory("dhcr-hier", "DHCR with hierarchical (HPA*) pathfinding, for large boards", [](Config& config) {
+    auto agent = std::make_unique<DynamicHamiltonianCycleRepair>(config.zig_zag_cycle());
+    agent->hierarchical = true;
+    return agent;
+  }),
 };
 
 void list_agents(std::ostream& out = std::cout) {
@@ -185,6 +354,11 @@ void print_help(const char* name, std::ostream& out = std::cout) {
   out << "  help                Show this message." << endl;
   out << "  list                List available agents." << endl;
   out << "  all                 Play all agents against each other, output csv summary." << endl;
+  out << "  bench               Benchmark all agents, output per-move latency csv." << endl;
+  out << "  convert <in> <out>  Convert a binary run log to json for visualize/." << endl;
+  out << "  show <log> <turn>   Print the state at one turn of a run log; seeks via the" << endl;
+  out << "                      keyframe index instead of replaying from the start." << endl;
+  out << "  merge <file>...     Merge results files from sharded runs, output summary table." << endl;
   out << "  <agent>             Play with the given agent." << endl;
   out << endl;
   out << "Optional arguments:" << endl;
@@ -197,7 +371,16 @@ void print_help(const char* name, std::ostream& out = std::cout) {
   out << "  -q, --quiet         Don't print extra output." << endl;
   out << "      --json <file>   Write log of one run a json file." << endl;
   out << "      --json-full     Don't encode json file to save size." << endl;
+  out << "      --log <file>    Stream a binary log of one run to a file." << endl;
+  out << "      --resume <file> Checkpoint finished rounds to a file; if the file already" << endl;
+  out << "                      exists, skip the rounds recorded in it and continue." << endl;
+  out << "      --shard <i>/<n> Play only every n-th round, as shard i of n. Write the" << endl;
+  out << "                      results with --resume and combine them with `merge`." << endl;
   out << "  -j, --threads <n>   Specify the maximum number of threads (default: " << def.num_threads << ")." << endl;
+  out << "  -b, --batch <n>     Rounds to step in lockstep per thread, for cheap agents" << endl;
+  out << "                      (default: " << def.batch_size << ", meaning no batching)." << endl;
+  out << "      --exact         Keep every round's turn count and compute quantiles exactly," << endl;
+  out << "                      instead of estimating them with bounded memory." << endl;
   out << endl;
   list_agents(out);
 }
@@ -226,6 +409,22 @@ void Config::parse_optional_args(int argc, const char** argv) {
     } else if (arg == "--json") {
       if (i+1 >= argc) throw std::invalid_argument("Missing argument to " + arg);
       json_file = argv[++i];
+    } else if (arg == "--log") {
+      if (i+1 >= argc) throw std::invalid_argument("Missing argument to " + arg);
+      log_file = argv[++i];
+    } else if (arg == "--resume") {
+      if (i+1 >= argc) throw std::invalid_argument("Missing argument to " + arg);
+      resume_file = argv[++i];
+    } else if (arg == "--shard") {
+      if (i+1 >= argc) throw std::invalid_argument("Missing argument to " + arg);
+      std::string spec = argv[++i];
+      size_t slash = spec.find('/');
+      if (slash == std::string::npos) throw std::invalid_argument("--shard expects i/n, e.g. --shard 2/8");
+      shard_index = std::stoi(spec.substr(0, slash)) - 1;
+      num_shards = std::stoi(spec.substr(slash+1));
+      if (num_shards < 1 || shard_index < 0 || shard_index >= num_shards) {
+        throw std::invalid_argument("--shard expects i/n with 1 <= i <= n");
+      }
     } else if (arg == "-t" || arg == "--trace") {
       trace = Trace::eat;
       num_rounds = 1;
@@ -237,6 +436,12 @@ void Config::parse_optional_args(int argc, const char** argv) {
     } else if (arg == "-j" || arg == "--threads" || arg == "--num-threads") {
       if (i+1 >= argc) throw std::invalid_argument("Missing argument to " + arg);
       num_threads = std::stoi(argv[++i]);
+    } else if (arg == "-b" || arg == "--batch") {
+      if (i+1 >= argc) throw std::invalid_argument("Missing argument to " + arg);
+      batch_size = std::stoi(argv[++i]);
+      if (batch_size < 1) throw std::invalid_argument("--batch expects a batch size of at least 1");
+    } else if (arg == "--exact") {
+      exact_stats = true;
     } else if (arg == "--no-color") {
       use_color = false;
     } else if (arg == "--json-full") {
@@ -370,17 +575,18 @@ void write_json(std::ostream& out, std::vector<AgentLog::LogEntry> const& xs, bo
   out << "]";
 }
 
-void write_json(std::ostream& out, AgentFactory const& agent, LoggedGame const& game, AgentLog const& agent_log, bool compact = true) {
+void write_json(std::ostream& out, std::string const& agent_name, std::string const& agent_description,
+                CoordRange size, Log const& log, AgentLog const& agent_log, bool compact = true) {
   out << "{" << std::endl;
-  out << "  \"agent\": \"" << agent.name << "\"," << std::endl;
-  out << "  \"agent_description\": \"" << agent.description << "\"," << std::endl;
-  out << "  \"size\": "; write_json(out, game.dimensions()); out << "," << std::endl;
-  out << "  \"snake_pos\": "; write_json_path(out, game.log.snake_pos, compact); out << "," << std::endl;
+  out << "  \"agent\": \"" << agent_name << "\"," << std::endl;
+  out << "  \"agent_description\": \"" << agent_description << "\"," << std::endl;
+  out << "  \"size\": "; write_json(out, size); out << "," << std::endl;
+  out << "  \"snake_pos\": "; write_json_path(out, log.snake_pos, compact); out << "," << std::endl;
   if (!compact) {
-    out << "  \"snake_size\": "; write_json(out, game.log.snake_size); out << "," << std::endl;
+    out << "  \"snake_size\": "; write_json(out, log.snake_size); out << "," << std::endl;
   }
-  out << "  \"apple_pos\": "; write_json(out, game.log.apple_pos); out << "," << std::endl;
-  out << "  \"eat_turns\": "; write_json(out, game.log.eat_turns);
+  out << "  \"apple_pos\": "; write_json(out, log.apple_pos); out << "," << std::endl;
+  out << "  \"eat_turns\": "; write_json(out, log.eat_turns);
   for (int i = 0; i < AgentLog::MAX_KEY; ++i) {
     if (!agent_log.logs[i].empty()) {
       out << "," << std::endl;
@@ -393,7 +599,319 @@ void write_json(std::ostream& out, AgentFactory const& agent, LoggedGame const&
 
 void write_json(std::string const& filename, AgentFactory const& agent, LoggedGame const& game, AgentLog const& agent_log, bool compact = true) {
   std::ofstream out(filename);
-  write_json(out, agent, game, agent_log, compact);
+  write_json(out, agent.name, agent.description, game.dimensions(), game.log, agent_log, compact);
+}
+
+//------------------------------------------------------------------------------
+// Binary run logs: recording and conversion to json
+//------------------------------------------------------------------------------
+
+// Play one game while streaming a binary log to a file.
+// Memory use stays O(board), no matter how long the game runs.
+void play_logged_to_file(AgentFactory const& agent, Config& config) {
+  Game game(config.board_size, config.rng.next_rng());
+  RunLogWriter writer(config.log_file, agent.name, agent.description, game);
+  StreamingAgentLog agent_log(writer);
+  auto a = agent.make(config);
+  while (!game.done()) {
+    if (config.trace == Trace::all) std::cout << game;
+    Dir dir = (*a)(game, &agent_log);
+    auto event = game.move(dir);
+    writer.move(dir, event, game);
+    if (event == Game::Event::eat && config.trace == Trace::eat) std::cout << game;
+  }
+  writer.finish(game.turn, game.win());
+}
+
+// Print the game state at one turn of a run log, without decoding the rest:
+// seeks through the keyframe index of the memory-mapped file.
+void show_run_log(std::string const& filename, int turn) {
+  ReplayReader reader(filename);
+  GameBase state(reader.dims);
+  turn = reader.state_at(turn, state);
+  std::cout << reader.agent_name << ", turn " << turn << "/" << reader.num_turns
+            << ", size " << state.snake.size()
+            << (turn == reader.num_turns ? reader.win ? " WIN!" : " LOSS" : "") << std::endl;
+  std::cout << box_draw_grid(state, use_color);
+}
+
+// Convert a binary run log to the json format used by visualize/
+void convert_run_log(std::string const& in_file, std::string const& out_file, bool compact) {
+  RunLogReader reader(in_file);
+  Log log;
+  AgentLog agent_log;
+  Coord pos = reader.start;
+  int snake_size = 1;
+  int turn = 0;
+  log.snake_pos.push_back(pos);
+  log.snake_size.push_back(snake_size);
+  log.apple_pos.push_back(reader.apple);
+  bool end = false;
+  while (!end) {
+    int tag = reader.next_tag();
+    if (!tag) break;
+    switch (tag) {
+      case 'm': {
+        Dir dir;
+        Game::Event event;
+        reader.read_move(dir, event);
+        turn++;
+        if (event != Game::Event::lose) pos = pos + dir;
+        if (event == Game::Event::eat) {
+          snake_size++;
+          log.eat_turns.push_back(turn);
+        }
+        log.snake_pos.push_back(pos);
+        log.snake_size.push_back(snake_size);
+        break;
+      }
+      case 'a': {
+        log.apple_pos.push_back(reader.read_apple());
+        break;
+      }
+      case 'k': {
+        // the moves already reconstruct the state, keyframes are for seeking
+        reader.skip_keyframe();
+        break;
+      }
+      case 'p': {
+        AgentLog::Key key;
+        int log_turn;
+        reader.read_agent_key_turn(key, log_turn);
+        agent_log.add(log_turn, key, reader.read_path());
+        break;
+      }
+      case 'g': {
+        AgentLog::Key key;
+        int log_turn;
+        reader.read_agent_key_turn(key, log_turn);
+        agent_log.add(log_turn, key, reader.read_grid());
+        break;
+      }
+      case 'c': {
+        AgentLog::Key key;
+        int log_turn;
+        reader.read_agent_key_turn(key, log_turn);
+        agent_log.add(log_turn, key, AgentLog::CopyEntry{});
+        break;
+      }
+      case 'e': {
+        int turns;
+        bool win;
+        reader.read_finish(turns, win);
+        end = true; // only the keyframe index follows
+        break;
+      }
+      default:
+        throw std::invalid_argument("Corrupt run log: unknown record");
+    }
+  }
+  std::ofstream out(out_file);
+  write_json(out, reader.agent_name, reader.agent_description, reader.dims, log, agent_log, compact);
+}
+
+//------------------------------------------------------------------------------
+// Round result files: checkpointing long campaigns
+//------------------------------------------------------------------------------
+
+// A binary file of per-round results, used to checkpoint long statistical
+// campaigns. Each finished round appends one small record, so a killed run
+// loses only the rounds that were still in flight; --resume <file> loads the
+// file, skips the recorded rounds and appends new ones to the same file.
+// The header pins the master rng state, board size, round count and agent
+// names: round i's rng is a pure function of the master state and i (see
+// RNG::stream_rng), so a round plays the same game no matter which run ends
+// up executing it.
+//
+// Format (all integers little endian):
+//   header: "SNKS", u8 version,
+//           u64 rng state (x2), u16 w, h, u32 num_rounds,
+//           u8 number of agents, u8-length-prefixed agent names
+//   records: u8 agent, u32 round, u32 turns, u8 win
+
+const char RESULTS_MAGIC[4] = {'S','N','K','S'};
+// version 2: rounds seeded with stream_rng instead of repeated jumps, so
+// version 1 files would resume with different games and must be rejected
+const uint8_t RESULTS_VERSION = 2;
+
+struct RoundResult {
+  int agent;
+  int round;
+  int turns;
+  bool win;
+};
+
+struct ResultsHeader {
+  uint64_t rng_state[2] = {0,0};
+  CoordRange board_size = {0,0};
+  int num_rounds = 0;
+  std::vector<std::string> agent_names;
+
+  bool operator == (ResultsHeader const& that) const {
+    return rng_state[0] == that.rng_state[0] && rng_state[1] == that.rng_state[1]
+        && board_size.w == that.board_size.w && board_size.h == that.board_size.h
+        && num_rounds == that.num_rounds && agent_names == that.agent_names;
+  }
+};
+
+// Read a results file; returns false if the file doesn't exist.
+// A partial trailing record (from a run that was killed mid-write) is dropped.
+bool read_results_file(std::string const& filename, ResultsHeader& header, std::vector<RoundResult>& results) {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in) return false;
+  char magic[4];
+  in.read(magic, sizeof(magic));
+  if (!std::equal(magic, magic+4, RESULTS_MAGIC) || read_u8(in) != RESULTS_VERSION) {
+    throw std::invalid_argument("Not a results file: " + filename);
+  }
+  header.rng_state[0] = read_u64(in);
+  header.rng_state[1] = read_u64(in);
+  header.board_size.w = read_u16(in);
+  header.board_size.h = read_u16(in);
+  header.num_rounds = (int)read_u32(in);
+  header.agent_names.resize(read_u8(in));
+  for (auto& name : header.agent_names) {
+    name = read_short_string(in);
+  }
+  while (true) {
+    int agent = in.get();
+    if (agent == std::char_traits<char>::eof()) break;
+    RoundResult r;
+    r.agent = agent;
+    r.round = (int)read_u32(in);
+    r.turns = (int)read_u32(in);
+    r.win = read_u8(in) != 0;
+    if (!in) break;
+    results.push_back(r);
+  }
+  return true;
+}
+
+// Appends one record per finished round. Writes go to a buffered stream under
+// a mutex and take a fraction of a round's play time, so the worker threads
+// never stall on the checkpoint.
+class ResultsWriter {
+private:
+  std::ofstream out;
+  std::mutex mutex;
+
+public:
+  void open(std::string const& filename, ResultsHeader const& header, bool append) {
+    out.open(filename, append ? std::ios::binary | std::ios::app : std::ios::binary);
+    if (!out) throw std::invalid_argument("Can't write results file: " + filename);
+    if (!append) {
+      out.write(RESULTS_MAGIC, sizeof(RESULTS_MAGIC));
+      write_u8(out, RESULTS_VERSION);
+      write_u64(out, header.rng_state[0]);
+      write_u64(out, header.rng_state[1]);
+      write_u16(out, (uint16_t)header.board_size.w);
+      write_u16(out, (uint16_t)header.board_size.h);
+      write_u32(out, (uint32_t)header.num_rounds);
+      write_u8(out, (uint8_t)header.agent_names.size());
+      for (auto const& name : header.agent_names) {
+        write_short_string(out, name);
+      }
+    }
+    out.flush();
+  }
+
+  void add(RoundResult const& r) {
+    std::lock_guard<std::mutex> lock(mutex);
+    write_u8(out, (uint8_t)r.agent);
+    write_u32(out, (uint32_t)r.round);
+    write_u32(out, (uint32_t)r.turns);
+    write_u8(out, r.win ? 1 : 0);
+    out.flush(); // a record is 10 bytes; a round is at least milliseconds
+  }
+};
+
+// Resume state for a campaign: which (agent,round) pairs are already done, the
+// stats of those rounds, and a writer for checkpointing new rounds.
+// Disabled (all no-ops) when config.resume_file is empty.
+struct Resume {
+  bool enabled = false;
+  std::vector<std::vector<bool>> done; // [agent][round]
+  std::vector<Stats> loaded;           // [agent], results of finished rounds
+  ResultsWriter writer;
+
+  // Call before splitting config.rng into per-round streams, so the header
+  // records the master state the streams are derived from.
+  void open(Config const& config, std::vector<std::string> const& agent_names) {
+    if (config.resume_file.empty()) return;
+    ResultsHeader header;
+    header.rng_state[0] = config.rng.state(0);
+    header.rng_state[1] = config.rng.state(1);
+    header.board_size = config.board_size;
+    header.num_rounds = config.num_rounds;
+    header.agent_names = agent_names;
+    ResultsHeader existing_header;
+    std::vector<RoundResult> results;
+    bool existing = read_results_file(config.resume_file, existing_header, results);
+    if (existing && !(existing_header == header)) {
+      throw std::invalid_argument("Results file is from a different campaign (seed, size, rounds or agents differ): " + config.resume_file);
+    }
+    done.assign(agent_names.size(), std::vector<bool>(config.num_rounds, false));
+    loaded.assign(agent_names.size(), Stats());
+    for (auto const& r : results) {
+      if (r.agent < (int)done.size() && r.round < config.num_rounds && !done[r.agent][r.round]) {
+        done[r.agent][r.round] = true;
+        loaded[r.agent].add(r.turns, r.win);
+      }
+    }
+    writer.open(config.resume_file, header, existing);
+    enabled = true;
+  }
+
+  bool is_done(int agent, int round) const {
+    return enabled && done[agent][round];
+  }
+  int num_done(int agent) const {
+    return enabled ? (int)loaded[agent].num_rounds : 0;
+  }
+  void add(int agent, int round, Game const& game) {
+    if (enabled) writer.add({agent, round, game.turn, game.win()});
+  }
+};
+
+// Combine the results files written by sharded runs (--shard i/n --resume
+// shard-i.bin) and print the same summary table as the `all` mode.
+// Duplicate (agent,round) records, e.g. from overlapping shard specs, are
+// counted once.
+void merge_results(int argc, const char** argv, std::ostream& out = std::cout) {
+  ResultsHeader header;
+  std::vector<std::vector<bool>> done;
+  std::vector<Stats> stats;
+  for (int i = 0; i < argc; ++i) {
+    ResultsHeader h;
+    std::vector<RoundResult> results;
+    if (!read_results_file(argv[i], h, results)) {
+      throw std::invalid_argument("Can't open results file: " + std::string(argv[i]));
+    }
+    if (i == 0) {
+      header = h;
+      done.assign(h.agent_names.size(), std::vector<bool>(h.num_rounds, false));
+      stats.assign(h.agent_names.size(), Stats());
+    } else if (!(h == header)) {
+      throw std::invalid_argument("Results file is from a different campaign (seed, size, rounds or agents differ): " + std::string(argv[i]));
+    }
+    for (auto const& r : results) {
+      if (r.agent < (int)done.size() && r.round < header.num_rounds && !done[r.agent][r.round]) {
+        done[r.agent][r.round] = true;
+        stats[r.agent].add(r.turns, r.win);
+      }
+    }
+  }
+  int missing = 0;
+  out << STATS_CSV_HEADER << std::endl;
+  for (size_t a = 0; a < stats.size(); ++a) {
+    write_stats_row(out, header.agent_names[a], stats[a]);
+    out << std::endl;
+    missing += header.num_rounds - (int)stats[a].num_rounds;
+  }
+  if (missing > 0) {
+    std::cerr << "warning: " << missing << " of " << header.num_rounds * (int)stats.size()
+              << " rounds are missing from the merged shards" << std::endl;
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -404,92 +922,358 @@ enum class Visualize {
   no, eat, all
 };
 
-template <typename Game>
-void play(Game& game, Agent& agent, Config const& config, AgentLog* log = nullptr) {
+// The inner loop. Traced selects tracing/logging at compile time: with
+// Traced=false and a concrete AgentT this compiles to a tight loop with a
+// direct (inlinable) agent call per move, no vtable dispatch and no per-move
+// trace branches or log checks.
+template <bool Traced, typename Game, typename AgentT>
+void play_loop(Game& game, AgentT& agent, Config const& config, AgentLog* log) {
   while (!game.done()) {
-    if (config.trace == Trace::all) std::cout << game;
+    if (Traced && config.trace == Trace::all) std::cout << game;
     auto event = game.move(agent(game,log));
-    if (event == Game::Event::eat && config.trace == Trace::eat) std::cout << game;
+    if (Traced && event == Game::Event::eat && config.trace == Trace::eat) std::cout << game;
+  }
+  if (Traced && config.trace == Trace::all) std::cout << game;
+}
+
+template <typename Game, typename AgentT>
+void play(Game& game, AgentT& agent, Config const& config, AgentLog* log) {
+  if (config.trace == Trace::no && log == nullptr) {
+    play_loop<false>(game, agent, config, nullptr);
+  } else {
+    play_loop<true>(game, agent, config, log);
   }
-  if (config.trace == Trace::all) std::cout << game;
 }
 
+// Throughput mode for cheap agents (AgentFactory::lockstep): play a batch of
+// rounds at once, advancing every live game by one move per pass over the
+// batch. The games in a batch are independent, so their dependent loads
+// (cycle order, occupancy words, free-cell index) can overlap in the
+// pipeline. Whether that wins depends on the cache: a single game's state
+// fits in L1 and stays hot when played sequentially, while a batch spreads
+// the same accesses over batch_size copies, so batching only pays off once a
+// single game misses L1 anyway. It is therefore opt-in via --batch; measure
+// before turning it on. Slots keep their agent and Game objects across
+// batches (reset() instead of reconstruction, no allocation per round), and
+// every round still gets its stream_rng(round), so batch size, like thread
+// count, has no effect on which games are played.
 template <typename AgentGen>
-Stats play_multiple_threaded(AgentGen make_agent, Config& config) {
-  std::mutex mutex;
+class LockstepRunner {
+  using AgentPtr = decltype(std::declval<AgentGen&>()(std::declval<Config&>()));
+  AgentGen make_agent;
+  std::vector<AgentPtr> agents; // slot state, reused across batches
+  std::vector<std::unique_ptr<Game>> games;
+public:
+  LockstepRunner(AgentGen make_agent) : make_agent(make_agent) {}
+
+  // Play the given rounds, calling on_done(round, game) as each game finishes
+  template <typename OnDone>
+  void play(Config& config, std::vector<int> const& rounds, OnDone const& on_done) {
+    int n = (int)rounds.size();
+    if ((int)agents.size() < n) {
+      agents.resize(n);
+      games.resize(n);
+    }
+    for (int i = 0; i < n; ++i) {
+      Config round_config = config;
+      // round i's rng is a pure function of (master rng, i), so no thread
+      // count, batch size, shard split or resume can change which game round
+      // i plays
+      round_config.rng = config.rng.stream_rng(rounds[i]);
+      if (agents[i]) agents[i]->reset(round_config.rng);
+      else agents[i] = make_agent(round_config); // potentially uses rng
+      if (games[i]) games[i]->reset(round_config.rng.next_rng());
+      else games[i] = std::make_unique<Game>(config.board_size, round_config.rng.next_rng());
+    }
+    if (config.trace != Trace::no) {
+      // lockstep would interleave the trace output, keep the games sequential
+      for (int i = 0; i < n; ++i) {
+        ::play(*games[i], *agents[i], config);
+        on_done(rounds[i], *games[i]);
+      }
+      return;
+    }
+    int live = n;
+    while (live > 0) {
+      for (int i = 0; i < n; ++i) {
+        if (games[i]->done()) continue;
+        games[i]->move((*agents[i])(*games[i]));
+        if (games[i]->done()) {
+          --live;
+          on_done(rounds[i], *games[i]);
+        }
+      }
+    }
+  }
+};
+
+template <typename AgentGen>
+Stats play_multiple_threaded(AgentGen make_agent, Config& config, std::string const& agent_name = "", bool lockstep = false) {
+  Resume resume;
+  resume.open(config, {agent_name});
+  config.zig_zag_cycle(); // build shared resources before config is copied per round
+  // Rounds are claimed with an atomic counter, stats are accumulated per
+  // thread and merged at the end; the workers never take a lock. Finishing a
+  // game only bumps the completed counter, progress is printed by a
+  // timer-driven reporter thread from a snapshot of that counter, so stat
+  // collection costs O(1) per game no matter how fast the agent is.
+  std::atomic<int> next_round(0);
+  std::atomic<int> completed(resume.num_done(0));
+  std::atomic<bool> finished(false);
+  std::vector<Stats> thread_stats(config.num_threads);
   std::vector<std::thread> threads;
-  int remaining = config.num_rounds;
-  Stats stats;
+  const int batch = lockstep ? config.batch_size : 1;
   for (int thread = 0; thread < config.num_threads; ++thread) {
     threads.push_back(std::thread([&,thread](){
+      // one agent per thread (a batch of them for lockstep agents), reset
+      // between rounds instead of reconstructed; reset() draws the same
+      // numbers as construction, so which rounds end up sharing an instance
+      // doesn't affect the games
+      LockstepRunner<AgentGen> runner(make_agent);
+      std::vector<int> rounds;
       while (true) {
-        std::unique_ptr<Agent> agent;
-        RNG rng;
-        {
-          std::lock_guard<std::mutex> guard(mutex);
-          if (remaining <= 0) return;
-          remaining--;
-          agent = make_agent(config); // potentially uses rng
-          rng = config.rng.next_rng();
-        }
-        Game game(config.board_size, rng);
-        play(game, *agent, config);
-        {
-          std::lock_guard<std::mutex> guard(mutex);
-          stats.add(game);
-          if (!config.quiet) {
-            std::cout << stats.wins.size() << "/" << config.num_rounds << "  " << stats << "\033[K\r" << std::flush;
-          }
+        int block = next_round.fetch_add(batch, std::memory_order_relaxed);
+        if (block >= config.num_rounds) return;
+        rounds.clear();
+        for (int round = block; round < std::min(block + batch, config.num_rounds); ++round) {
+          if (config.in_shard(round) && !resume.is_done(0, round)) rounds.push_back(round);
         }
+        runner.play(config, rounds, [&](int round, Game const& game) {
+          thread_stats[thread].add(game);
+          resume.add(0, round, game);
+          completed.fetch_add(1, std::memory_order_relaxed);
+        });
       }
     }));
   }
+  std::thread reporter;
+  if (!config.quiet) {
+    reporter = std::thread([&](){
+      while (!finished.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        int done = completed.load(std::memory_order_relaxed);
+        std::cout << done << "/" << config.num_shard_rounds() << "\033[K\r" << std::flush;
+      }
+    });
+  }
   // wait
   for (auto& t : threads) {
     t.join();
   }
+  finished.store(true, std::memory_order_relaxed);
+  if (reporter.joinable()) reporter.join();
+  // merge
+  Stats stats;
+  for (auto const& s : thread_stats) {
+    stats.merge(s);
+  }
+  if (resume.enabled) stats.merge(resume.loaded[0]);
   // done
   if (!config.quiet) std::cout << "\033[K\r";
   return stats;
 }
 
 template <typename AgentGen>
-Stats play_multiple(AgentGen make_agent, Config& config) {
-  if (config.num_threads > 1) return play_multiple_threaded(make_agent, config);
+Stats play_multiple(AgentGen make_agent, Config& config, std::string const& agent_name, bool lockstep) {
+  // resuming and sharding need the per-round rng streams of the threaded version
+  if (config.num_threads > 1 || !config.resume_file.empty() || config.num_shards > 1) {
+    return play_multiple_threaded(make_agent, config, agent_name, lockstep);
+  }
   Stats stats;
-  for (int i = 0; i < config.num_rounds; ++i) {
-    Game game(config.board_size, config.rng.next_rng());
-    auto agent = make_agent(config);
-    play(game, *agent, config);
-    stats.add(game);
-    if (!config.quiet) {
-      if (!game.win()) std::cout << game;
-      std::cout << (i+1) << "/" << config.num_rounds << "  " << stats << "\033[K\r" << std::flush;
+  // rate-limit the progress line: printing it sorts the turns for quantiles,
+  // which would dominate the runtime of fast agents if done per game
+  config.zig_zag_cycle(); // build shared resources before config is copied per round
+  using clock = std::chrono::steady_clock;
+  auto next_print = clock::now();
+  const int batch = lockstep ? config.batch_size : 1;
+  LockstepRunner<AgentGen> runner(make_agent);
+  std::vector<int> rounds;
+  int completed = 0;
+  for (int i = 0; i < config.num_rounds; i += batch) {
+    rounds.clear();
+    for (int round = i; round < std::min(i + batch, config.num_rounds); ++round) {
+      rounds.push_back(round);
     }
+    runner.play(config, rounds, [&](int round, Game const& game) {
+      stats.add(game);
+      ++completed;
+      if (!config.quiet) {
+        if (!game.win()) std::cout << game;
+        if (clock::now() >= next_print) {
+          next_print = clock::now() + std::chrono::milliseconds(250);
+          std::cout << completed << "/" << config.num_rounds << "  " << stats << "\033[K\r" << std::flush;
+        }
+      }
+    });
   }
   if (!config.quiet) std::cout << "\033[K\r";
   return stats;
 }
 
 
-void play_all_agents(Config& config, std::ostream& out = std::cout) {
+//------------------------------------------------------------------------------
+// Benchmarking
+//------------------------------------------------------------------------------
+
+// Per-move agent latencies of one or more games, in nanoseconds.
+// Samples are split by game phase, because agent cost grows with snake length.
+struct BenchResult {
+  static const int NUM_PHASES = 3; // early/mid/late game, by snake length
+  std::vector<int64_t> samples[NUM_PHASES];
+
+  void add(int phase, int64_t ns) {
+    samples[phase].push_back(ns);
+  }
+  std::vector<int64_t> all() const {
+    std::vector<int64_t> out;
+    for (auto const& phase : samples) {
+      out.insert(out.end(), phase.begin(), phase.end());
+    }
+    return out;
+  }
+};
+
+double percentile(std::vector<int64_t>& xs, double p) {
+  if (xs.empty()) return 0;
+  size_t i = (size_t)(p * (xs.size() - 1));
+  std::nth_element(xs.begin(), xs.begin() + i, xs.end());
+  return (double)xs[i];
+}
+
+// Like play(), but timestamping every agent call
+template <typename Game>
+void play_bench(Game& game, Agent& agent, BenchResult& result) {
+  using clock = std::chrono::steady_clock;
+  while (!game.done()) {
+    int phase = std::min(BenchResult::NUM_PHASES - 1,
+                         game.snake.size() * BenchResult::NUM_PHASES / game.grid.size());
+    auto t0 = clock::now();
+    Dir dir = agent(game);
+    auto t1 = clock::now();
+    result.add(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(t1-t0).count());
+    game.move(dir);
+  }
+}
+
+// Benchmark all agents, print a csv in the same style as play_all_agents.
+// Runs single threaded, so the latencies aren't polluted by other rounds.
+void bench_all_agents(Config& config, std::ostream& out = std::cout) {
   using namespace std;
-  out << "agent, mean, stddev, min, q.25, median, q.75, max, lost" << endl;
+  out << "agent, moves/sec, mean ns, p50 ns, p99 ns, max ns, early ns, mid ns, late ns" << endl;
   for (auto const& agent : agents) {
     out << left << setw(15) << agent.name << ", " << flush;
-    auto stats = play_multiple(agent.make, config);
-    out << right << fixed << setprecision(1) << setw(10);
-    out << setw(8) << mean(stats.turns) << ", ";
-    out << setw(8) << stddev(stats.turns) << ", ";
-    out << setprecision(0);
-    for (auto q : quantiles(stats.turns)) {
-      out << setw(8) << q << ", ";
+    Config round_config = config;
+    BenchResult result;
+    for (int i = 0; i < config.num_rounds; ++i) {
+      round_config.rng = config.rng.next_rng();
+      Game game(config.board_size, round_config.rng.next_rng());
+      auto a = agent.make(round_config);
+      play_bench(game, *a, result);
     }
-    out << setprecision(1);
-    out << setw(8) << ((1-mean(stats.wins))*100) << "%" << endl;
+    auto all = result.all();
+    double total_ns = 0;
+    int64_t max_ns = 0;
+    for (auto ns : all) {
+      total_ns += (double)ns;
+      max_ns = std::max(max_ns, ns);
+    }
+    out << right << fixed << setprecision(0);
+    out << setw(9) << (all.empty() ? 0. : all.size() / (total_ns * 1e-9)) << ", ";
+    out << setw(8) << (all.empty() ? 0. : total_ns / all.size()) << ", ";
+    out << setw(8) << percentile(all, 0.50) << ", ";
+    out << setw(8) << percentile(all, 0.99) << ", ";
+    out << setw(8) << (double)max_ns;
+    for (auto& phase : result.samples) {
+      double sum = 0;
+      for (auto ns : phase) sum += (double)ns;
+      out << ", " << setw(8) << (phase.empty() ? 0. : sum / phase.size());
+    }
+    out << endl;
   }
 }
 
+// Run all agents. All (agent,round) pairs are scheduled on one shared pool of
+// threads, so the straggling last rounds of one agent overlap with the next
+// agent's rounds instead of leaving cores idle at every agent boundary.
+// Each agent's csv row is printed as soon as its last round completes, so with
+// agents of different speeds the rows can appear out of order.
+void play_all_agents(Config& config, std::ostream& out = std::cout) {
+  using namespace std;
+  const int num_agents = (int)std::size(agents);
+  const int num_rounds = config.num_rounds;
+  Resume resume;
+  {
+    std::vector<std::string> names;
+    for (auto const& a : agents) names.push_back(a.name);
+    resume.open(config, names);
+  }
+  config.zig_zag_cycle(); // build shared resources before config is copied per round
+  out << STATS_CSV_HEADER << endl;
+  std::atomic<int> next_task(0);
+  std::atomic<int> completed(0);
+  std::vector<std::atomic<int>> rounds_left(num_agents);
+  for (auto& r : rounds_left) r.store(num_rounds);
+  std::vector<std::vector<Stats>> thread_stats(config.num_threads, std::vector<Stats>(num_agents));
+  std::mutex out_mutex;
+  std::vector<std::thread> threads;
+  for (int thread = 0; thread < config.num_threads; ++thread) {
+    threads.push_back(std::thread([&,thread](){
+      // one instance of each agent per thread, reset between rounds
+      std::vector<std::unique_ptr<Agent>> agent(num_agents);
+      while (true) {
+        int task = next_task.fetch_add(1, std::memory_order_relaxed);
+        if (task >= num_agents * num_rounds) return;
+        int agent_i = task / num_rounds, round = task % num_rounds;
+        if (config.in_shard(round) && !resume.is_done(agent_i, round)) {
+          Config round_config = config;
+          // streams are numbered in the same nested order as running the
+          // agents one by one, so the results match the sequential version
+          round_config.rng = config.rng.stream_rng((uint64_t)agent_i * num_rounds + round);
+          if (agent[agent_i]) agent[agent_i]->reset(round_config.rng);
+          else agent[agent_i] = agents[agent_i].make(round_config);
+          Game game(config.board_size, round_config.rng.next_rng());
+          agents[agent_i].play_game(game, *agent[agent_i], config);
+          thread_stats[thread][agent_i].add(game);
+          resume.add(agent_i, round, game);
+          completed.fetch_add(1, std::memory_order_relaxed);
+        }
+        // the thread that finishes an agent's last round prints its row; the
+        // acq_rel decrement makes all other threads' adds visible to it
+        if (rounds_left[agent_i].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          Stats stats;
+          for (auto const& ts : thread_stats) {
+            stats.merge(ts[agent_i]);
+          }
+          if (resume.enabled) stats.merge(resume.loaded[agent_i]);
+          std::ostringstream row;
+          write_stats_row(row, agents[agent_i].name, stats);
+          std::lock_guard<std::mutex> lock(out_mutex);
+          out << row.str() << "\033[K" << endl;
+        }
+      }
+    }));
+  }
+  // progress comes from a timer-driven reporter instead of the workers, so
+  // finishing a round never touches the console or the output mutex
+  std::atomic<bool> finished(false);
+  std::thread reporter;
+  if (!config.quiet) {
+    reporter = std::thread([&](){
+      while (!finished.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        int done = completed.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(out_mutex);
+        std::cout << done << "/" << (num_agents * num_rounds) << "\033[K\r" << std::flush;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  finished.store(true, std::memory_order_relaxed);
+  if (reporter.joinable()) reporter.join();
+}
+
 //------------------------------------------------------------------------------
 // Optimization
 // This is a hacky algorihtm to optimize algorithm parameters
@@ -509,8 +1293,8 @@ struct ParameterizedAgentFactory {
 struct ParameterizedCellTreeAgent : ParameterizedAgentFactory {
   ParameterizedCellTreeAgent() : ParameterizedAgentFactory(9,0,5000) {}
   
-  std::unique_ptr<Agent> make(std::vector<int> params, Config&) const override {
-    auto agent = std::make_unique<CellTreeAgent>();
+  std::unique_ptr<Agent> make(std::vector<int> params, Config& config) const override {
+    auto agent = std::make_unique<CellTreeAgent>(config.board_size);
     auto param = params.begin();
     agent->same_cell_penalty = *param++;
     agent->new_cell_penalty = *param++;
@@ -527,35 +1311,117 @@ struct ParameterizedCellTreeAgent : ParameterizedAgentFactory {
 };
 
 double score(Stats const& stats) {
-  return mean(stats.turns) + 1e10 * (1 - mean(stats.wins));
+  return stats.mean_turns() + 1e10 * stats.loss_rate();
 }
 
+// Population based parallel optimizer.
+// Every generation evaluates a population of candidates: the incumbent, re-run
+// on fresh seeds to keep its score honest (like the yellow re-runs of the old
+// serial hill climber), and perturbations of it with one or more parameters
+// changed. All (candidate,round) pairs run on one shared thread pool, and all
+// candidates of a generation share the same per-round seeds, so they are
+// compared on common random numbers.
+// Racing: a candidate whose partial score is already statistically worse than
+// the incumbent has its remaining rounds aborted; with a population of slight
+// variations most candidates lose the race long before round num_rounds.
 void optimize_agent(ParameterizedAgentFactory& agent, Config& config, std::ostream& out = std::cout) {
   using namespace std;
-  int num_runs = 1000;
-  int step_size = 100;
+  const int population = 8;
+  const int num_generations = 125; // population * generations = 1000 evaluations
+  const int step_size = 100;
+  const int min_race_rounds = std::max(4, config.num_rounds / 8);
   double best_score = 1e100;
   std::vector<int> best_params = agent.min_param_value;
-  for (int i = 0; i < num_runs; ++i) {
-    std::vector<int> params = best_params;
-    size_t which = i % (agent.num_params() + 1);
-    if (which == 0) {
-      // re-run
-    } else {
-      size_t j = which - 1;
-      do {
-        int delta = config.rng.random(step_size*2+1) - step_size;
-        params[j] = std::max(agent.min_param_value[j], std::min(agent.max_param_value[j], params[j] + delta));
-      } while (params[j] == best_params[j]);
+  for (int gen = 0; gen < num_generations; ++gen) {
+    // candidate 0 is the incumbent, the rest perturb a few parameters each
+    std::vector<std::vector<int>> params(population, best_params);
+    for (int c = 1; c < population; ++c) {
+      int num_perturbed = 1 + (int)config.rng.random(3);
+      for (int p = 0; p < num_perturbed; ++p) {
+        size_t j = config.rng.random((int)agent.num_params());
+        do {
+          int delta = config.rng.random(step_size*2+1) - step_size;
+          params[c][j] = std::max(agent.min_param_value[j], std::min(agent.max_param_value[j], best_params[j] + delta));
+        } while (params[c][j] == best_params[j]);
+      }
+    }
+    // per-round seeds, shared by all candidates of this generation
+    std::vector<RNG> round_rngs;
+    round_rngs.reserve(config.num_rounds);
+    for (int i = 0; i < config.num_rounds; ++i) {
+      round_rngs.push_back(config.rng.next_rng());
+    }
+    // per-candidate counters that the racing check reads while rounds run
+    std::vector<std::atomic<bool>> aborted(population);
+    std::vector<std::atomic<int>> rounds_done(population), losses(population);
+    std::vector<std::atomic<int64_t>> turns_sum(population), turns_sq(population);
+    std::vector<std::atomic<int>> abort_round(population);
+    for (int c = 0; c < population; ++c) {
+      aborted[c] = false;
+      rounds_done[c] = losses[c] = 0;
+      turns_sum[c] = turns_sq[c] = 0;
+      abort_round[c] = config.num_rounds;
+    }
+    std::vector<std::vector<Stats>> thread_stats(config.num_threads, std::vector<Stats>(population));
+    std::atomic<int> next_task(0);
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < config.num_threads; ++thread) {
+      threads.push_back(std::thread([&,thread](){
+        while (true) {
+          int task = next_task.fetch_add(1, std::memory_order_relaxed);
+          if (task >= population * config.num_rounds) return;
+          // round-major order, so all candidates progress roughly together
+          int c = task % population, round = task / population;
+          if (aborted[c].load(std::memory_order_relaxed)) continue;
+          Config round_config = config;
+          round_config.rng = round_rngs[round];
+          auto a = agent.make(params[c], round_config);
+          Game game(config.board_size, round_config.rng.next_rng());
+          play(game, *a, config);
+          thread_stats[thread][c].add(game);
+          if (game.win()) {
+            turns_sum[c] += game.turn;
+            turns_sq[c] += (int64_t)game.turn * game.turn;
+          } else {
+            losses[c]++;
+          }
+          int k = rounds_done[c].fetch_add(1, std::memory_order_relaxed) + 1;
+          // racing: abort once even an optimistic score can't beat the incumbent
+          if (c != 0 && k >= min_race_rounds && best_score < 1e99 && !aborted[c]) {
+            double n = k - losses[c];
+            double m = n > 0 ? turns_sum[c] / n : 0;
+            double var = n > 0 ? std::max(0., turns_sq[c]/n - m*m) : 0;
+            double lower = m - 2*sqrt(var/std::max(n,1.)) + 1e10 * losses[c] / config.num_rounds;
+            if (lower > best_score) {
+              aborted[c] = true;
+              abort_round[c] = k;
+            }
+          }
+        }
+      }));
     }
-    auto stats = play_multiple([&agent,&params](Config& config){return agent.make(params, config);}, config);
-    auto score = ::score(stats);
-    std::cout << (which == 0 ? yellow : score < best_score ? green : white)(std::to_string(score));
-    std::cout << ":  " << params;
-    std::cout << std::endl;
-    if (which == 0 || score < best_score) {
-      best_score = score;
-      best_params = params;
+    for (auto& t : threads) {
+      t.join();
+    }
+    // collect scores, print one line per candidate like the serial optimizer
+    for (int c = 0; c < population; ++c) {
+      Stats stats;
+      for (auto const& ts : thread_stats) {
+        stats.merge(ts[c]);
+      }
+      auto score = ::score(stats);
+      if (aborted[c]) {
+        std::cout << white(std::to_string(score)) << ":  " << params[c];
+        std::cout << "  (aborted after " << abort_round[c] << " rounds)" << std::endl;
+        continue;
+      }
+      std::cout << (c == 0 ? yellow : score < best_score ? green : white)(std::to_string(score));
+      std::cout << ":  " << params[c];
+      std::cout << std::endl;
+      if (c == 0 || score < best_score) {
+        best_score = score;
+        best_params = params[c];
+      }
     }
   }
 }
@@ -577,6 +1443,25 @@ int main(int argc, const char** argv) {
       config.quiet = true;
       config.parse_optional_args(argc-2, argv+2);
       play_all_agents(config);
+    } else if (mode == "bench") {
+      Config config;
+      config.quiet = true;
+      config.num_rounds = 10;
+      config.parse_optional_args(argc-2, argv+2);
+      bench_all_agents(config);
+    } else if (mode == "convert") {
+      if (argc < 4) throw std::invalid_argument("Usage: convert <in> <out>");
+      Config config;
+      config.parse_optional_args(argc-4, argv+4);
+      convert_run_log(argv[2], argv[3], config.json_compact);
+    } else if (mode == "show") {
+      if (argc < 4) throw std::invalid_argument("Usage: show <log> <turn>");
+      Config config;
+      config.parse_optional_args(argc-4, argv+4);
+      show_run_log(argv[2], std::stoi(argv[3]));
+    } else if (mode == "merge") {
+      if (argc < 3) throw std::invalid_argument("Usage: merge <file>...");
+      merge_results(argc-2, argv+2);
     } else if (mode == "optimize-cell") {
       Config config;
       config.parse_optional_args(argc-2, argv+2);
@@ -586,7 +1471,9 @@ int main(int argc, const char** argv) {
       auto agent = find_agent(mode);
       Config config;
       config.parse_optional_args(argc-2, argv+2);
-      if (!config.json_file.empty()) {
+      if (!config.log_file.empty()) {
+        play_logged_to_file(agent, config);
+      } else if (!config.json_file.empty()) {
         LoggedGame game(config.board_size, config.rng.next_rng());
         AgentLog agent_log;
         auto a = agent.make(config);
@@ -595,8 +1482,9 @@ int main(int argc, const char** argv) {
           write_json(config.json_file, agent, game, agent_log, config.json_compact);
         }
       } else {
-        auto stats = play_multiple(agent.make, config);
+        auto stats = agent.play_stats(config);
         std::cout << stats << std::endl;
+        write_perf_counters(std::cout, stats);
       }
     }
   } catch (std::exception const& e) {
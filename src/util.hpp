@@ -5,6 +5,8 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdint>
+#include <limits>
+#include <assert.h>
 #include "random.hpp"
 
 //------------------------------------------------------------------------------
@@ -110,6 +112,19 @@ const Coord INVALID = {-1,-1};
 const Coord NOT_VISITED = {-1,-1};
 const Coord ROOT = {-2,-2};
 
+// A Coord packed into 2x16 bits, for grid-sized data structures: at half the
+// size, the search grids (Step::from), the snake ring buffer and GridPath stay
+// in cache on large boards. Coord remains the arithmetic/API type; Coord16
+// converts implicitly in both directions and deliberately defines no operators
+// of its own, so mixed expressions resolve through Coord.
+// The sentinels (INVALID, ROOT) are negative and survive the round trip.
+struct Coord16 {
+  int16_t x, y;
+  Coord16() = default;
+  constexpr Coord16(Coord a) : x((int16_t)a.x), y((int16_t)a.y) {}
+  constexpr operator Coord() const { return Coord{x, y}; }
+};
+
 //------------------------------------------------------------------------------
 // Coordinate Grid
 //------------------------------------------------------------------------------
@@ -232,6 +247,313 @@ public:
   inline const_iterator end() const { return &data[w*h]; }
 };
 
+//------------------------------------------------------------------------------
+// Static Grid
+//------------------------------------------------------------------------------
+
+// A Grid<T> with compile-time dimensions.
+// The data lives inline (no allocation) and the index stride is a constant, so
+// the compiler can turn row offsets into shifts for power-of-two widths and
+// unroll or vectorize row loops. The interface matches Grid<T>, and the
+// templated search routines (generic_shortest_path, flood_fill, ...) accept
+// either. Use this in kernels that are compiled for a fixed board size; the
+// general code paths stay on the runtime-sized Grid<T>.
+template <typename T, int W, int H>
+class StaticGrid {
+private:
+  T data[W*H];
+public:
+  static constexpr int w = W, h = H;
+  StaticGrid(T const& init = T()) {
+    std::fill(begin(), end(), init);
+  }
+  StaticGrid(CoordRange range, T const& init = T()) : StaticGrid(init) {
+    assert(range.w == W && range.h == H);
+  }
+  static inline constexpr int size() {
+    return W*H;
+  }
+  inline T& operator [] (Coord a) {
+    return data[a.x + W*a.y];
+  }
+  inline T const& operator [] (Coord a) const {
+    return data[a.x + W*a.y];
+  }
+
+  static inline constexpr CoordRange coords() {
+    return {W,H};
+  }
+  static inline constexpr CoordRange dimensions() {
+    return coords();
+  }
+  static inline constexpr bool valid(Coord a) {
+    return a.x >= 0 && a.x < W && a.y >= 0 && a.y < H;
+  }
+
+  // is the grid clear, i.e. inside the range and equal to ClearValue<T>::value()
+  inline bool is_clear(Coord a) const {
+    return valid(a) && (*this)[a] == ClearValue<T>::value();
+  }
+
+  using iterator = T*;
+  inline iterator begin() { return data; }
+  inline iterator end() { return &data[W*H]; }
+
+  using const_iterator = const T*;
+  inline const_iterator begin() const { return data; }
+  inline const_iterator end() const { return &data[W*H]; }
+};
+
+//------------------------------------------------------------------------------
+// Bit Grid
+//------------------------------------------------------------------------------
+
+// A grid of booleans, packed 64 cells per word.
+// Each row starts on a word boundary, so operations on rectangles can work on
+// whole words at a time: compared to Grid<bool>, scans, counts and whole-grid
+// comparisons touch 64x less memory.
+// Padding bits past the end of a row are kept at 0.
+class BitGrid {
+private:
+  uint64_t* data;
+  int row_words;
+
+  inline static uint64_t bit(int x) {
+    return uint64_t(1) << (x & 63);
+  }
+  // mask of the bits [a,b) within a single word, 0 <= a < b <= 64
+  inline static uint64_t span_mask(int a, int b) {
+    return (b - a == 64 ? ~uint64_t(0) : (uint64_t(1) << (b - a)) - 1) << a;
+  }
+  inline uint64_t const* row(int y) const { return data + (size_t)y*row_words; }
+  inline uint64_t* row(int y) { return data + (size_t)y*row_words; }
+  // mask of the valid bits in the last word of a row
+  inline uint64_t tail_mask() const {
+    return span_mask(0, w - (row_words-1)*64);
+  }
+  inline size_t num_words() const {
+    return (size_t)row_words * h;
+  }
+
+public:
+  const int w,h;
+
+  BitGrid(CoordRange range, bool init = false)
+    : BitGrid(range.w, range.h, init)
+  {}
+  BitGrid(int w, int h, bool init = false)
+    : data(new uint64_t[(size_t)((w+63)/64) * h])
+    , row_words((w+63)/64)
+    , w(w), h(h)
+  {
+    if (init) {
+      for (int y=0; y<h; ++y) {
+        for (int i=0; i<row_words; ++i) {
+          row(y)[i] = i == row_words-1 ? tail_mask() : ~uint64_t(0);
+        }
+      }
+    } else {
+      std::fill(data, data + num_words(), 0);
+    }
+  }
+  BitGrid(BitGrid const& that)
+    : data(new uint64_t[that.num_words()])
+    , row_words(that.row_words)
+    , w(that.w), h(that.h)
+  {
+    std::copy(that.data, that.data + num_words(), data);
+  }
+  BitGrid(BitGrid&& that)
+    : data(that.data), row_words(that.row_words), w(that.w), h(that.h)
+  {
+    that.data = nullptr;
+  }
+  ~BitGrid() {
+    delete[] data;
+  }
+
+  inline int size() const {
+    return w*h;
+  }
+  inline CoordRange coords() const {
+    return {w,h};
+  }
+  inline CoordRange dimensions() const {
+    return coords();
+  }
+  inline bool valid(Coord a) const {
+    return coords().valid(a);
+  }
+
+  inline bool operator [] (Coord a) const {
+    return (row(a.y)[a.x >> 6] >> (a.x & 63)) & 1;
+  }
+  // proxy so that grid[c] = x works
+  class reference {
+  private:
+    uint64_t* word;
+    uint64_t mask;
+  public:
+    inline reference(uint64_t* word, uint64_t mask) : word(word), mask(mask) {}
+    inline reference& operator = (bool x) {
+      if (x) *word |= mask; else *word &= ~mask;
+      return *this;
+    }
+    inline operator bool () const {
+      return (*word & mask) != 0;
+    }
+  };
+  inline reference operator [] (Coord a) {
+    return reference(&row(a.y)[a.x >> 6], bit(a.x));
+  }
+
+  // is the grid clear, i.e. inside the range and false
+  inline bool is_clear(Coord a) const {
+    return valid(a) && !(*this)[a];
+  }
+
+  // set all cells to false
+  void clear() {
+    std::fill(data, data + num_words(), 0);
+  }
+
+  // is any cell in the rectangle [x0,x1) x [y0,y1) set?
+  bool any(int x0, int x1, int y0, int y1) const {
+    if (x0 >= x1 || y0 >= y1) return false;
+    int first = x0 >> 6, last = (x1-1) >> 6;
+    for (int y=y0; y<y1; ++y) {
+      uint64_t const* r = row(y);
+      if (first == last) {
+        if (r[first] & span_mask(x0 & 63, x1 - first*64)) return true;
+      } else {
+        if (r[first] & span_mask(x0 & 63, 64)) return true;
+        for (int i=first+1; i<last; ++i) {
+          if (r[i]) return true;
+        }
+        if (r[last] & span_mask(0, x1 - last*64)) return true;
+      }
+    }
+    return false;
+  }
+
+  // number of set cells
+  int count() const {
+    int n = 0;
+    for (size_t i=0; i<num_words(); ++i) {
+      n += __builtin_popcountll(data[i]);
+    }
+    return n;
+  }
+
+  // are all cells set?
+  bool all() const {
+    for (int y=0; y<h; ++y) {
+      for (int i=0; i<row_words; ++i) {
+        if (row(y)[i] != (i == row_words-1 ? tail_mask() : ~uint64_t(0))) return false;
+      }
+    }
+    return true;
+  }
+
+  // call f(c) for every cell where this and that differ; word-parallel, so
+  // the common all-equal case costs one compare per 64 cells.
+  // Grids must have the same dimensions.
+  template <typename F>
+  void for_each_diff(BitGrid const& that, F f) const {
+    for (int y=0; y<h; ++y) {
+      for (int i=0; i<row_words; ++i) {
+        uint64_t d = row(y)[i] ^ that.row(y)[i];
+        while (d) {
+          f(Coord{i*64 + __builtin_ctzll(d), y});
+          d &= d-1;
+        }
+      }
+    }
+  }
+
+  bool operator == (BitGrid const& that) const {
+    return w == that.w && h == that.h
+        && std::equal(data, data + num_words(), that.data);
+  }
+  bool operator != (BitGrid const& that) const {
+    return !(*this == that);
+  }
+
+  // word-parallel union, grids must have the same dimensions
+  BitGrid& operator |= (BitGrid const& that) {
+    for (size_t i=0; i<num_words(); ++i) {
+      data[i] |= that.data[i];
+    }
+    return *this;
+  }
+
+  // raw word access for callers that want to do their own word-parallel work;
+  // the word i of row y covers cells x in [64i, 64i+64)
+  inline int words_per_row() const { return row_words; }
+  inline uint64_t word(int y, int i) const { return row(y)[i]; }
+};
+
+//------------------------------------------------------------------------------
+// Stamped Grid
+//------------------------------------------------------------------------------
+
+// A grid that can be cleared in O(1).
+// Each cell carries a generation stamp; a cell whose stamp doesn't match the
+// current generation reads as the clear value. Intended as reusable scratch
+// space for per-move searches, so they don't pay an allocation and an O(w*h)
+// fill before touching a single node.
+template <typename T>
+class StampedGrid {
+private:
+  Grid<T> data;
+  Grid<uint32_t> stamps;
+  uint32_t generation;
+  T clear_value;
+public:
+  const int w,h;
+  StampedGrid(CoordRange range, T const& clear_value = T())
+    : data(range, clear_value)
+    , stamps(range, 0)
+    , generation(0)
+    , clear_value(clear_value)
+    , w(range.w), h(range.h)
+  {}
+
+  // Forget all values, in O(1)
+  void clear() {
+    ++generation;
+    if (generation == 0) {
+      // the generation counter wrapped around, old stamps could collide
+      std::fill(stamps.begin(), stamps.end(), 0);
+      generation = 1;
+    }
+  }
+
+  inline T const& operator [] (Coord a) const {
+    return stamps[a] == generation ? data[a] : clear_value;
+  }
+  inline T& operator [] (Coord a) {
+    if (stamps[a] != generation) {
+      stamps[a] = generation;
+      data[a] = clear_value;
+    }
+    return data[a];
+  }
+
+  inline int size() const {
+    return data.size();
+  }
+  inline CoordRange coords() const {
+    return data.coords();
+  }
+  inline CoordRange dimensions() const {
+    return data.coords();
+  }
+  inline bool valid(Coord a) const {
+    return data.valid(a);
+  }
+};
+
 //------------------------------------------------------------------------------
 // Ring Buffer
 //------------------------------------------------------------------------------
@@ -272,6 +594,9 @@ public:
   bool empty() const {
     return begin_ == end_;
   }
+  void clear() {
+    begin_ = end_ = 0;
+  }
 
   T& front() {
     return data[begin_];
@@ -392,6 +717,135 @@ std::vector<double> quantiles(std::vector<T> const& xs) {
   return quantiles;
 }
 
+// Running mean and variance (Welford's algorithm): O(1) per observation and
+// O(1) memory, and mergeable, so per-thread and sharded accumulators can be
+// combined without keeping the observations around.
+class StreamingMeanVar {
+private:
+  int64_t n = 0;
+  double mean_ = 0.;
+  double m2 = 0.; // sum of squared deviations from the running mean
+public:
+  void add(double x) {
+    n++;
+    double d = x - mean_;
+    mean_ += d / n;
+    m2 += d * (x - mean_);
+  }
+  void merge(StreamingMeanVar const& that) {
+    if (that.n == 0) return;
+    int64_t total = n + that.n;
+    double d = that.mean_ - mean_;
+    m2 += that.m2 + d * d * ((double)n * that.n / total);
+    mean_ += d * that.n / total;
+    n = total;
+  }
+  int64_t count() const { return n; }
+  double mean() const { return mean_; }
+  // sample variance, like variance() above
+  double variance() const { return n > 1 ? m2 / (n - 1) : 0.; }
+  double stddev() const { return std::sqrt(variance()); }
+};
+
+// Streaming quantile estimator, a merging t-digest: observations are buffered
+// and periodically compacted into a short sorted list of centroids whose
+// allowed weight shrinks towards the tails, so extreme quantiles stay
+// accurate while the memory use is bounded by the compression constant.
+// Adding is O(1) amortized, and two digests merge by compacting the
+// concatenated centroid lists. Min and max are tracked exactly.
+class StreamingQuantiles {
+private:
+  struct Centroid {
+    double mean;
+    double weight;
+  };
+  // compacted lazily, so quantile() can stay const
+  mutable std::vector<Centroid> centroids; // sorted by mean
+  mutable std::vector<double> buffer;      // observations not yet compacted
+  mutable bool dirty = false;              // centroids need another compaction pass
+  double total = 0.;
+  double min_ = std::numeric_limits<double>::infinity();
+  double max_ = -std::numeric_limits<double>::infinity();
+  static const int COMPRESSION = 100; // ~2x this many centroids after compaction
+  static const size_t BUFFER_SIZE = 512;
+
+  // a centroid may hold at most 4·n·q(1-q)/compression observations: big near
+  // the median, small near the tails
+  double weight_limit(double q) const {
+    return std::max(1., 4. * total * q * (1. - q) / COMPRESSION);
+  }
+  void compact() const {
+    if (buffer.empty() && !dirty) return;
+    for (double x : buffer) centroids.push_back({x, 1.});
+    buffer.clear();
+    dirty = false;
+    std::sort(centroids.begin(), centroids.end(),
+              [](Centroid const& a, Centroid const& b) { return a.mean < b.mean; });
+    std::vector<Centroid> out;
+    out.reserve(2 * COMPRESSION);
+    double w = 0.; // weight before the centroid being built
+    Centroid cur = centroids[0];
+    for (size_t i = 1; i < centroids.size(); ++i) {
+      Centroid const& c = centroids[i];
+      double q = (w + (cur.weight + c.weight) / 2) / total;
+      if (cur.weight + c.weight <= weight_limit(q)) {
+        cur.mean += (c.mean - cur.mean) * c.weight / (cur.weight + c.weight);
+        cur.weight += c.weight;
+      } else {
+        out.push_back(cur);
+        w += cur.weight;
+        cur = c;
+      }
+    }
+    out.push_back(cur);
+    centroids = std::move(out);
+  }
+
+public:
+  void add(double x) {
+    buffer.push_back(x);
+    total += 1.;
+    min_ = std::min(min_, x);
+    max_ = std::max(max_, x);
+    if (buffer.size() >= BUFFER_SIZE) compact();
+  }
+  void merge(StreamingQuantiles const& that) {
+    if (that.total == 0) return;
+    that.compact();
+    centroids.insert(centroids.end(), that.centroids.begin(), that.centroids.end());
+    dirty = true;
+    total += that.total;
+    min_ = std::min(min_, that.min_);
+    max_ = std::max(max_, that.max_);
+    compact();
+  }
+  int64_t count() const { return (int64_t)total; }
+  double min() const { return total > 0 ? min_ : 0.; }
+  double max() const { return total > 0 ? max_ : 0.; }
+  // estimate the q'th quantile, treating each centroid's mean as sitting at
+  // the middle of its weight and interpolating linearly in between
+  double quantile(double q) const {
+    compact();
+    if (centroids.empty()) return 0.;
+    double target = q * total;
+    double prev_pos = 0., prev_val = min_, w = 0.;
+    for (Centroid const& c : centroids) {
+      double pos = w + c.weight / 2;
+      if (target < pos) {
+        if (pos <= prev_pos) return c.mean;
+        double t = (target - prev_pos) / (pos - prev_pos);
+        return prev_val + (c.mean - prev_val) * t;
+      }
+      prev_pos = pos;
+      prev_val = c.mean;
+      w += c.weight;
+    }
+    if (total <= prev_pos) return max_;
+    double t = (target - prev_pos) / (total - prev_pos);
+    return prev_val + (max_ - prev_val) * t;
+  }
+};
+
 template <typename T>
 std::ostream& operator << (std::ostream& out, std::vector<T> const& xs) {
   out << "[";
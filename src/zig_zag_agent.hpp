@@ -25,8 +25,8 @@ Dir zig_zag_path(CoordRange dims, Coord c) {
   }
 }
 // A Hamiltonian cycle
-Grid<Coord> make_zig_zag_path(CoordRange dims) {
-  Grid<Coord> path(dims);
+GridPath make_zig_zag_path(CoordRange dims) {
+  GridPath path(dims);
   for (auto c : dims) {
     path[c] = c + zig_zag_path(dims, c);
   }
@@ -51,10 +51,18 @@ struct FixedZigZagAgent : Agent {
 
 // agent that maintains a hamiltonian path
 struct FixedCycleAgent : Agent {
-  Grid<Coord> path;
-  
-  FixedCycleAgent(Grid<Coord> const& path) : path(path) {}
-  
+  GridPath path;
+  bool randomize = false; // pick a fresh random cycle each round
+
+  FixedCycleAgent(GridPath const& path) : path(path) {}
+
+  void reset(RNG& rng) override {
+    if (randomize) {
+      GridPath fresh = random_hamiltonian_cycle(path.dimensions(), rng);
+      std::copy(fresh.begin(), fresh.end(), path.begin());
+    }
+  }
+
   Dir operator () (Game const& game, AgentLog* log = nullptr) override {
     if (log && game.turn == 0) {
       log->add(game.turn, AgentLog::Key::cycle, cycle_to_path(path));
@@ -68,24 +76,23 @@ struct FixedCycleAgent : Agent {
 // Agent: Fixed path with shortcuts
 //------------------------------------------------------------------------------
 
-bool any(Grid<bool> const& grid, int x0, int x1, int y0, int y1) {
-  for (int y=y0; y<y1; ++y) {
-    for (int x=x0; x<x1; ++x) {
-      if (grid[{x,y}]) return true;
-    }
-  }
-  return false;
+bool any(BitGrid const& grid, int x0, int x1, int y0, int y1) {
+  return grid.any(x0, x1, y0, y1);
 }
 
 struct CutAgent : Agent {
   bool move_right = true;
   bool quick_dir_change = true;
 
+  void reset(RNG&) override {
+    move_right = true;
+  }
+
   Dir operator () (Game const& game, AgentLog* log = nullptr) override {
     Coord c = game.snake_pos();
     Coord target = game.apple_pos;
     int w = game.grid.w, h = game.grid.h;
-    Grid<bool> const& grid = game.grid;
+    BitGrid const& grid = game.grid;
     if (c.x == 0) move_right = true;
     if (c.x == w-1 || (c.y == 0 && c.x > 0)) move_right = false;
     if (move_right) {